@@ -0,0 +1,159 @@
+#include "interface.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * Heap layout analyzer
+ *
+ * Every arena is walked block by block under its lock, the report is only
+ * formatted once all locks are dropped, since formatting may allocate
+ *
+ * Blocks in a thread cache or a fast bin are still marked as allocated, so they count as used
+ */
+
+typedef struct mm_bin_report {
+	size_t blocks;
+	size_t bytes;
+	size_t largest;
+} mm_bin_report_t;
+
+typedef struct mm_heap_report {
+	size_t arenas;
+	size_t heap_bytes;
+	size_t used_blocks;
+	size_t used_bytes;
+	size_t free_blocks;
+	size_t free_bytes;
+	size_t top_bytes;
+	size_t largest_free;
+	size_t header_bytes;
+	size_t slab_runs;
+	size_t slab_used_bytes;
+	mm_bin_report_t bins[MM_BIN_COUNT];
+} mm_heap_report_t;
+
+// Expects the arena's lock to be held
+static void mm_analyze_arena(arena_t* a, mm_heap_report_t* r) {
+	r->slab_runs += a->slab_runs;
+	r->slab_used_bytes += a->slab_used;
+
+	if (!a->initialized)
+		return;
+
+	r->arenas++;
+	r->heap_bytes += a->heap_size;
+
+	for (header_t* h = a->heap_start; (void*)h != a->heap_end; h = MM_WALK_NEXT(a, h)) {
+		size_t s = MM_GET_SIZE(h);
+		if (!MM_IS_FREE(h)) {
+			// The next header's prev_foot is part of the payload
+			r->header_bytes += MM_METADATA_SIZE - MM_SPILL;
+			r->used_blocks++;
+			r->used_bytes += s + MM_SPILL;
+			continue;
+		}
+
+		r->header_bytes += MM_METADATA_SIZE;
+		r->free_bytes += s;
+		r->largest_free = MM_MAX(r->largest_free, s);
+
+		// The top chunk isn't on any list
+		if (h == a->top) {
+			r->top_bytes += s;
+			continue;
+		}
+
+		mm_bin_report_t* b = &r->bins[mm_idx_from_size(s)];
+		b->blocks++;
+		b->bytes += s;
+		b->largest = MM_MAX(b->largest, s);
+		r->free_blocks++;
+	}
+}
+
+typedef struct mm_json {
+	char* buf;
+	size_t len;
+	size_t pos;
+} mm_json_t;
+
+// Appends like snprintf, pos keeps counting past the end of the buffer
+__attribute__((format(printf, 2, 3))) static void mm_json(mm_json_t* j, const char* fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(j->pos < j->len ? j->buf + j->pos : NULL, j->pos < j->len ? j->len - j->pos : 0, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		j->pos += (size_t)n;
+}
+
+static inline double mm_ratio(size_t part, size_t whole) { return whole ? (double)part / (double)whole : 0.0; }
+
+// A return of len or more means the report was cut short
+size_t mm_heap_analyze(char* buf, size_t len) {
+	mm_heap_report_t r;
+	memset(&r, 0, sizeof(r));
+
+	for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+		arena_t* a = mm_arena_at(i);
+		if (!a)
+			continue;
+
+		MM_LOCK(a);
+		mm_analyze_arena(a, &r);
+		MM_UNLOCK(a);
+	}
+
+	size_t mmap_bytes = __atomic_load_n(&mm_counters.mmap_bytes, __ATOMIC_RELAXED);
+	size_t mmap_chunks = __atomic_load_n(&mm_counters.mmap_chunks, __ATOMIC_RELAXED);
+	size_t requested = __atomic_load_n(&mm_counters.requested_bytes, __ATOMIC_RELAXED);
+	size_t usable = __atomic_load_n(&mm_counters.usable_bytes, __ATOMIC_RELAXED);
+
+	size_t slab_bytes = r.slab_runs * MM_SLAB_RUN_SIZE;
+	size_t slab_header_bytes = r.slab_runs * MM_SLAB_OBJS_OFFSET;
+	size_t mmap_header_bytes = mmap_chunks * MM_METADATA_SIZE;
+	size_t waste = usable > requested ? usable - requested : 0;
+
+	mm_json_t j = {buf, len, 0};
+
+	mm_json(&j, "{\"arenas\":%zu,", r.arenas);
+	mm_json(&j,
+	        "\"heap\":{\"bytes\":%zu,\"used_blocks\":%zu,\"used_bytes\":%zu,\"free_blocks\":%zu,"
+	        "\"free_bytes\":%zu,\"top_bytes\":%zu,\"largest_free\":%zu,\"header_bytes\":%zu},",
+	        r.heap_bytes, r.used_blocks, r.used_bytes, r.free_blocks, r.free_bytes, r.top_bytes, r.largest_free,
+	        r.header_bytes);
+	mm_json(&j, "\"slabs\":{\"runs\":%zu,\"bytes\":%zu,\"used_bytes\":%zu,\"header_bytes\":%zu},", r.slab_runs,
+	        slab_bytes, r.slab_used_bytes, slab_header_bytes);
+	mm_json(&j, "\"mmap\":{\"chunks\":%zu,\"bytes\":%zu,\"header_bytes\":%zu},", mmap_chunks, mmap_bytes,
+	        mmap_header_bytes);
+
+	// 0 when any request up to the free total would fit the largest block, close to 1 when it's all crumbs
+	mm_json(&j, "\"external_fragmentation\":%.4f,", r.free_bytes ? 1.0 - mm_ratio(r.largest_free, r.free_bytes) : 0.0);
+	mm_json(&j, "\"header_overhead\":{\"bytes\":%zu,\"ratio\":%.4f},",
+	        r.header_bytes + slab_header_bytes + mmap_header_bytes,
+	        mm_ratio(r.header_bytes + slab_header_bytes + mmap_header_bytes, r.heap_bytes + slab_bytes + mmap_bytes));
+
+	// Summed over every allocation made while MM_OPT_WASTE was on, not just the live ones
+	mm_json(&j,
+	        "\"internal_waste\":{\"tracked\":%s,\"requested_bytes\":%zu,\"usable_bytes\":%zu,\"bytes\":%zu,"
+	        "\"ratio\":%.4f},",
+	        MM_OPT(waste) ? "true" : "false", requested, usable, waste, mm_ratio(waste, usable));
+
+	mm_json(&j, "\"bins\":[");
+	_Bool first = 1;
+	for (size_t i = 0; i < MM_BIN_COUNT; i++) {
+		mm_bin_report_t* b = &r.bins[i];
+		if (!b->blocks)
+			continue;
+
+		mm_json(&j, "%s{\"bin\":%zu,\"min_size\":%zu,\"blocks\":%zu,\"bytes\":%zu,\"largest\":%zu}", first ? "" : ",",
+		        i, mm_size_from_idx(i), b->blocks, b->bytes, b->largest);
+		first = 0;
+	}
+	mm_json(&j, "]}");
+
+	return j.pos;
+}
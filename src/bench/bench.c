@@ -0,0 +1,410 @@
+/*
+ * Allocator benchmarks
+ *
+ * Built against the system allocator, `make bench` runs it once as is
+ * and once with malloc.so preloaded, so both report the same workloads
+ *
+ * Each workload runs in its own child process, so peak RSS and the
+ * perf counters only cover that workload
+ *
+ * Usage: bench.bin [-s scale] [workload...]
+ */
+
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SAMPLE_EVERY 16
+#define MAX_SAMPLES ((size_t)1 << 22)
+#define THREADS 4
+
+static size_t scale = 1;
+
+// Latencies of every SAMPLE_EVERY-th operation, from every thread
+static uint64_t* samples;
+static size_t sample_count;
+
+static volatile uintptr_t sink;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline void record(uint64_t ns) {
+	size_t i = __atomic_fetch_add(&sample_count, 1, __ATOMIC_RELAXED);
+	if (i < MAX_SAMPLES)
+		samples[i] = ns;
+}
+
+// Runs stmt, timing it if it's a sampled operation
+#define TIMED(i, stmt)                                                                                                 \
+	do {                                                                                                               \
+		if ((i) % SAMPLE_EVERY == 0) {                                                                                 \
+			uint64_t t0_ = now_ns();                                                                                   \
+			stmt;                                                                                                      \
+			record(now_ns() - t0_);                                                                                    \
+		} else {                                                                                                       \
+			stmt;                                                                                                      \
+		}                                                                                                              \
+	} while (0)
+
+static inline uint64_t rnd(uint64_t* s) {
+	uint64_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+// Touches the first and last byte, so the block is really used
+static inline void touch(void* p, size_t size) {
+	uint8_t* b = p;
+	b[0] = (uint8_t)size;
+	b[size - 1] = (uint8_t)size;
+	sink = (uintptr_t)p;
+}
+
+// malloc/free of the same size in a loop, for each size class
+static uint64_t pingpong(void) {
+	static const size_t sizes[] = {16, 64, 256, 1024, 4096, 32 * 1024, 256 * 1024};
+	uint64_t ops = 0;
+
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		size_t n = (sizes[s] >= 32 * 1024 ? 50000 : 500000) * scale;
+
+		for (size_t i = 0; i < n; i++) {
+			void* p;
+			TIMED(ops, p = malloc(sizes[s]));
+			touch(p, sizes[s]);
+			ops++;
+			TIMED(ops, free(p));
+			ops++;
+		}
+	}
+
+	return ops;
+}
+
+// Mostly small random sizes, replacing random live blocks
+static uint64_t churn(void) {
+	enum { SLOTS = 4096 };
+	static void* slots[SLOTS];
+	uint64_t seed = 88172645463325252ull;
+	uint64_t ops = 0;
+	size_t n = 2000000 * scale;
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t r = rnd(&seed);
+		size_t idx = r % SLOTS;
+		size_t pick = (r >> 16) % 100;
+		size_t size = pick < 75 ? 1 + (r >> 24) % 256 : pick < 95 ? 257 + (r >> 24) % 3840 : 4097 + (r >> 24) % 61440;
+
+		TIMED(ops, free(slots[idx]));
+		ops++;
+		TIMED(ops, slots[idx] = malloc(size));
+		touch(slots[idx], size);
+		ops++;
+	}
+
+	for (size_t i = 0; i < SLOTS; i++) {
+		free(slots[i]);
+		slots[i] = NULL;
+	}
+
+	return ops + SLOTS;
+}
+
+// Buffers growing by half their size at a time, up to 1MiB
+static uint64_t realloc_chain(void) {
+	uint64_t ops = 0;
+	size_t n = 5000 * scale;
+
+	for (size_t i = 0; i < n; i++) {
+		size_t size = 16;
+		void* p;
+		TIMED(ops, p = malloc(size));
+		touch(p, size);
+		ops++;
+
+		while (size < 1024 * 1024) {
+			size += size / 2;
+			TIMED(ops, p = realloc(p, size));
+			touch(p, size);
+			ops++;
+		}
+
+		TIMED(ops, free(p));
+		ops++;
+	}
+
+	return ops;
+}
+
+/*
+ * Larson-style server churn:
+ * every thread replaces random blocks of one buffer per round,
+ * then the buffers rotate, so most blocks are freed by another thread
+ */
+enum { LARSON_SLOTS = 2048 };
+
+static void* larson_bufs[THREADS][LARSON_SLOTS];
+static pthread_barrier_t larson_barrier;
+static uint64_t larson_ops;
+
+static void* larson_worker(void* arg) {
+	size_t t = (size_t)(uintptr_t)arg;
+	uint64_t seed = 0x9E3779B97F4A7C15ull * (t + 1);
+	uint64_t ops = 0;
+	size_t rounds = 50 * scale;
+
+	for (size_t round = 0; round < rounds; round++) {
+		void** buf = larson_bufs[(t + round) % THREADS];
+
+		for (size_t i = 0; i < 20000; i++) {
+			uint64_t r = rnd(&seed);
+			size_t idx = r % LARSON_SLOTS;
+			size_t size = 16 + (r >> 20) % 1009;
+
+			TIMED(ops, free(buf[idx]));
+			ops++;
+			TIMED(ops, buf[idx] = malloc(size));
+			touch(buf[idx], size);
+			ops++;
+		}
+
+		pthread_barrier_wait(&larson_barrier);
+	}
+
+	__atomic_fetch_add(&larson_ops, ops, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static uint64_t larson(void) {
+	pthread_t tids[THREADS];
+	pthread_barrier_init(&larson_barrier, NULL, THREADS);
+
+	for (size_t t = 0; t < THREADS; t++)
+		pthread_create(&tids[t], NULL, larson_worker, (void*)(uintptr_t)t);
+	for (size_t t = 0; t < THREADS; t++)
+		pthread_join(tids[t], NULL);
+
+	for (size_t t = 0; t < THREADS; t++) {
+		for (size_t i = 0; i < LARSON_SLOTS; i++)
+			free(larson_bufs[t][i]);
+	}
+
+	pthread_barrier_destroy(&larson_barrier);
+	return larson_ops;
+}
+
+/*
+ * Fragmentation soak:
+ * the size distribution shifts between phases while blocks of the old
+ * phases stay live, the report ends with the RSS left for the live bytes
+ */
+static size_t soak_live;
+
+static size_t rss_bytes(void) {
+	long pages = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%*ld %ld", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+	return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t soak(void) {
+	enum { SLOTS = 32768 };
+	static void* slots[SLOTS];
+	static size_t sizes[SLOTS];
+	static const size_t phase_max[] = {128, 4096, 512, 64 * 1024, 64};
+	const size_t phases = sizeof(phase_max) / sizeof(phase_max[0]);
+	uint64_t seed = 0x2545F4914F6CDD1Dull;
+	uint64_t ops = 0;
+	size_t rounds = 4 * scale;
+
+	for (size_t round = 0; round < rounds * phases; round++) {
+		size_t max = phase_max[round % phases];
+
+		for (size_t i = 0; i < 200000; i++) {
+			uint64_t r = rnd(&seed);
+			size_t idx = r % SLOTS;
+
+			// Some blocks outlive their phase
+			if (slots[idx] && (r >> 40) % 4 == 0)
+				continue;
+
+			size_t size = 1 + (r >> 16) % max;
+
+			TIMED(ops, free(slots[idx]));
+			ops++;
+			soak_live -= sizes[idx];
+
+			TIMED(ops, slots[idx] = malloc(size));
+			memset(slots[idx], (int)size, size);
+			ops++;
+			sizes[idx] = size;
+			soak_live += size;
+		}
+	}
+
+	return ops;
+}
+
+typedef struct workload {
+	const char* name;
+	uint64_t (*run)(void);
+} workload_t;
+
+static const workload_t workloads[] = {
+	{"pingpong", pingpong}, {"churn", churn}, {"realloc", realloc_chain}, {"larson", larson}, {"soak", soak},
+};
+
+static int perf_open(uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void perf_print(int fd) {
+	uint64_t v;
+	if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v))
+		printf(" %12s", "n/a");
+	else
+		printf(" %12llu", (unsigned long long)v);
+}
+
+static int cmp_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(size_t n, double p) {
+	if (!n)
+		return 0;
+	size_t i = (size_t)(p * (double)(n - 1));
+	return samples[i];
+}
+
+// Runs in the child, everything it allocates is the workload's own
+static void run_workload(const workload_t* w) {
+	samples = mmap(NULL, MAX_SAMPLES * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (samples == MAP_FAILED) {
+		perror("mmap");
+		_exit(1);
+	}
+
+	int cache = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+	int tlb = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	                                            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+
+	if (cache >= 0)
+		ioctl(cache, PERF_EVENT_IOC_ENABLE, 0);
+	if (tlb >= 0)
+		ioctl(tlb, PERF_EVENT_IOC_ENABLE, 0);
+
+	uint64_t start = now_ns();
+	uint64_t ops = w->run();
+	uint64_t elapsed = now_ns() - start;
+
+	if (cache >= 0)
+		ioctl(cache, PERF_EVENT_IOC_DISABLE, 0);
+	if (tlb >= 0)
+		ioctl(tlb, PERF_EVENT_IOC_DISABLE, 0);
+
+	size_t n = sample_count < MAX_SAMPLES ? sample_count : MAX_SAMPLES;
+	qsort(samples, n, sizeof(uint64_t), cmp_u64);
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("%-10s %12.0f %8llu %8llu %8llu %12ld", w->name, (double)ops * 1e9 / (double)elapsed,
+	       (unsigned long long)percentile(n, 0.50), (unsigned long long)percentile(n, 0.99),
+	       (unsigned long long)percentile(n, 0.999), ru.ru_maxrss);
+	perf_print(cache);
+	perf_print(tlb);
+
+	if (w->run == soak)
+		printf("  rss/live %.2f", (double)rss_bytes() / (double)(soak_live ? soak_live : 1));
+
+	printf("\n");
+	fflush(stdout);
+}
+
+static void usage(const char* argv0) {
+	fprintf(stderr, "Usage: %s [-s scale] [workload...]\nWorkloads:", argv0);
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+		fprintf(stderr, " %s", workloads[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	int first = 1;
+
+	if (argc > 2 && !strcmp(argv[1], "-s")) {
+		scale = strtoul(argv[2], NULL, 10);
+		if (!scale)
+			usage(argv[0]);
+		first = 3;
+	}
+
+	printf("%-10s %12s %8s %8s %8s %12s %12s %12s\n", "workload", "ops/s", "p50 ns", "p99 ns", "p99.9 ns",
+	       "peak RSS KiB", "cache miss", "dTLB miss");
+	fflush(stdout);
+
+	for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		const workload_t* w = &workloads[i];
+
+		if (argc > first) {
+			int selected = 0;
+			for (int a = first; a < argc; a++)
+				selected |= !strcmp(argv[a], w->name);
+			if (!selected)
+				continue;
+		}
+
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+
+		if (pid == 0) {
+			run_workload(w);
+			_exit(0);
+		}
+
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "%s failed\n", w->name);
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,321 @@
+/*
+ * Trace replay
+ *
+ * Re-executes a trace recorded with malloc-trace.so against whichever
+ * allocator the process uses, so `LD_PRELOAD=malloc.so` replays it on
+ * this allocator and no preload replays it on the system one
+ *
+ * Records are replayed in the order they were reserved, from a single
+ * thread, so every run sees the exact same sequence of calls
+ *
+ * Reports throughput, RSS over time and fragmentation (RSS / live bytes)
+ *
+ * Usage: replay.bin [-n samples] trace
+ */
+
+#include "../trace.h"
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Live blocks by the id they had in the traced process
+ * The table is mapped directly, so it never goes through the allocator
+ * being measured, it uses linear probing with backward shift deletion
+ * and doubles once half full, so its own RSS follows the live blocks
+ */
+typedef struct entry {
+	uint64_t id;
+	void* ptr;
+	uint64_t size;
+} entry_t;
+
+static entry_t* table;
+static size_t table_mask;
+static size_t table_used;
+
+static size_t live_bytes;
+static size_t peak_live;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// The trace's own pages are file backed, so only anonymous memory is counted
+static size_t rss_bytes(void) {
+	unsigned long resident = 0, shared = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%*u %lu %lu", &resident, &shared) != 2)
+			resident = shared = 0;
+		fclose(f);
+	}
+	return (size_t)(resident - shared) * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static inline size_t slot_of(uint64_t id) { return (size_t)((id >> 4) * 0x9E3779B97F4A7C15ull) & table_mask; }
+
+static entry_t* lookup(uint64_t id) {
+	for (size_t i = slot_of(id);; i = (i + 1) & table_mask) {
+		if (table[i].id == id)
+			return &table[i];
+		if (!table[i].id)
+			return NULL;
+	}
+}
+
+static entry_t* map_table(size_t slots) {
+	entry_t* t = mmap(NULL, slots * sizeof(entry_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (t == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return t;
+}
+
+static void put(entry_t e) {
+	size_t i = slot_of(e.id);
+	while (table[i].id)
+		i = (i + 1) & table_mask;
+
+	table[i] = e;
+	table_used++;
+}
+
+static void grow_table(void) {
+	entry_t* old = table;
+	size_t slots = table_mask + 1;
+
+	table = map_table(2 * slots);
+	table_mask = 2 * slots - 1;
+	table_used = 0;
+
+	for (size_t i = 0; i < slots; i++) {
+		if (old[i].id)
+			put(old[i]);
+	}
+
+	munmap(old, slots * sizeof(entry_t));
+}
+
+static void remove_entry(entry_t* e) {
+	live_bytes -= e->size;
+	table_used--;
+
+	size_t hole = (size_t)(e - table);
+	for (size_t i = (hole + 1) & table_mask; table[i].id; i = (i + 1) & table_mask) {
+		// An entry may move back into the hole only if it doesn't pass its home slot
+		size_t home = slot_of(table[i].id);
+		if (((i - home) & table_mask) >= ((i - hole) & table_mask)) {
+			table[hole] = table[i];
+			hole = i;
+		}
+	}
+	table[hole].id = 0;
+}
+
+// Writes a byte per page, so the block counts towards RSS like it would in the program
+static void touch(void* p, size_t size) {
+	volatile uint8_t* b = p;
+	for (size_t i = 0; i < size; i += 4096)
+		b[i] = 1;
+	if (size)
+		b[size - 1] = 1;
+}
+
+static size_t collisions;
+
+static void insert(uint64_t id, void* ptr, uint64_t size) {
+	touch(ptr, size);
+
+	// The traced program can't have two live blocks at one address,
+	// so the old one's free was lost to the ring wrapping
+	entry_t* e = lookup(id);
+	if (e) {
+		free(e->ptr);
+		remove_entry(e);
+		collisions++;
+	}
+
+	if (2 * (table_used + 1) > table_mask + 1)
+		grow_table();
+
+	put((entry_t){id, ptr, size});
+	live_bytes += size;
+	if (live_bytes > peak_live)
+		peak_live = live_bytes;
+}
+
+static void usage(const char* argv0) {
+	fprintf(stderr, "Usage: %s [-n samples] trace\n", argv0);
+	exit(1);
+}
+
+int main(int argc, char** argv) {
+	size_t samples = 20;
+	int arg = 1;
+
+	if (argc > 3 && !strcmp(argv[1], "-n")) {
+		samples = strtoul(argv[2], NULL, 10);
+		if (!samples)
+			usage(argv[0]);
+		arg = 3;
+	}
+	if (arg != argc - 1)
+		usage(argv[0]);
+
+	int fd = open(argv[arg], O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(argv[arg]);
+		return 1;
+	}
+
+	if ((size_t)st.st_size < sizeof(mm_trace_header_t)) {
+		fprintf(stderr, "%s: not a trace\n", argv[arg]);
+		return 1;
+	}
+
+	const mm_trace_header_t* h = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (h == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	if (memcmp(h->magic, MM_TRACE_MAGIC, sizeof(h->magic)) || h->version != MM_TRACE_VERSION ||
+	    h->record_size != sizeof(mm_trace_record_t) || !h->capacity ||
+	    (size_t)st.st_size < sizeof(*h) + h->capacity * sizeof(mm_trace_record_t)) {
+		fprintf(stderr, "%s: not a trace, or another version\n", argv[arg]);
+		return 1;
+	}
+
+	const mm_trace_record_t* ring = (const mm_trace_record_t*)(h + 1);
+	uint64_t count = h->count;
+	uint64_t first = count > h->capacity ? count - h->capacity : 0;
+	uint64_t total = count - first;
+
+	table = map_table(1024);
+	table_mask = 1024 - 1;
+
+	if (first)
+		printf("ring wrapped, replaying the last %llu of %llu records\n", (unsigned long long)total,
+		       (unsigned long long)count);
+
+	printf("%12s %10s %12s %12s %8s\n", "record", "trace ms", "live KiB", "RSS KiB", "rss/live");
+
+	uint64_t every = total / samples ? total / samples : 1;
+	uint64_t ops = 0, skipped = 0, failed = 0;
+	uint32_t threads = 0;
+	size_t peak_rss = 0;
+	double rss_sum = 0, live_sum = 0;
+	uint64_t elapsed = 0;
+	uint64_t t0 = now_ns();
+
+	for (uint64_t n = first; n < count; n++) {
+		const mm_trace_record_t* r = &ring[n % h->capacity];
+		entry_t* e;
+		void* p;
+
+		if (r->thread > threads)
+			threads = r->thread;
+
+		switch (r->op) {
+		case MM_TRACE_MALLOC:
+			p = malloc(r->size);
+			if (p)
+				insert(r->id, p, r->size);
+			else
+				failed++;
+			break;
+		case MM_TRACE_CALLOC:
+			p = calloc(1, r->size);
+			if (p)
+				insert(r->id, p, r->size);
+			else
+				failed++;
+			break;
+		case MM_TRACE_MEMALIGN:
+			// memalign takes every alignment the recorded calls could,
+			// posix_memalign would reject those below a pointer's size
+			p = memalign((size_t)r->old, r->size);
+			if (p)
+				insert(r->id, p, r->size);
+			else
+				failed++;
+			break;
+		case MM_TRACE_REALLOC:
+			// It failed, the old block stays live
+			if (!r->id)
+				continue;
+
+			e = r->old ? lookup(r->old) : NULL;
+			if (r->old && !e)
+				skipped++;
+
+			p = realloc(e ? e->ptr : NULL, r->size);
+			if (!p) {
+				failed++;
+				break;
+			}
+
+			// The old entry goes first, inserting may move it
+			if (e)
+				remove_entry(e);
+			insert(r->id, p, r->size);
+			break;
+		case MM_TRACE_FREE:
+			e = lookup(r->id);
+			if (!e) {
+				skipped++;
+				break;
+			}
+			free(e->ptr);
+			remove_entry(e);
+			break;
+		default:
+			// Reserved but never written
+			skipped++;
+			continue;
+		}
+
+		ops++;
+
+		if ((n - first + 1) % every == 0 || n + 1 == count) {
+			elapsed += now_ns() - t0;
+
+			size_t rss = rss_bytes();
+			if (rss > peak_rss)
+				peak_rss = rss;
+			double ratio = (double)rss / (double)(live_bytes ? live_bytes : 1);
+			rss_sum += (double)rss;
+			live_sum += (double)live_bytes;
+
+			printf("%12llu %10.1f %12zu %12zu %8.2f\n", (unsigned long long)(n - first + 1), r->ts_ns / 1e6,
+			       live_bytes / 1024, rss / 1024, ratio);
+			fflush(stdout);
+
+			t0 = now_ns();
+		}
+	}
+
+	double secs = elapsed ? elapsed / 1e9 : 1e-9;
+	printf("\nops %llu (skipped %llu, failed %llu, id collisions %zu), threads %u\n", (unsigned long long)ops,
+	       (unsigned long long)skipped, (unsigned long long)failed, collisions, threads);
+	printf("ops/s %.0f\n", ops / secs);
+	// Weighted by the live bytes, so nearly empty samples don't dominate
+	printf("peak live KiB %zu, peak sampled RSS KiB %zu, rss/live %.2f\n", peak_live / 1024, peak_rss / 1024,
+	       live_sum ? rss_sum / live_sum : 0.0);
+
+	return 0;
+}
@@ -2,76 +2,103 @@
 
 #include <stdio.h>
 
-void mm_coalesce_prev(header_t** header_ptr) {
+static inline size_t mm_fast_idx(size_t size) { return size / MM_ALIGNMENT - 1; }
+
+// Takes back a held block of exactly size bytes
+static header_t* mm_fast_get(arena_t* a, size_t size) {
+	if (size > MM_OPT(fast_max_size))
+		return NULL;
+
+	header_t** bin = &a->fast_bins[mm_fast_idx(size)];
+	header_t* h = *bin;
+	if (!h)
+		return NULL;
+
+	*bin = *(header_t**)MM_PAYLOAD(h);
+	a->fast_blocks--;
+	a->fast_bytes -= size + MM_METADATA_SIZE;
+
+	return h;
+}
+
+void mm_coalesce_prev(arena_t* a, header_t** header_ptr) {
 	header_t* h = *header_ptr;
-	header_t* prev = h->prev;
 
-	if (!prev || !MM_IS_FREE(prev)) {
+	if (!MM_IS_PREV_FREE(h)) {
 		return;
 	}
 
-	mm_remove_free(prev);
+	header_t* prev = MM_PREV_HEADER(h);
+	mm_remove_free(a, prev);
 
 	size_t size = MM_GET_SIZE(h);
 	size_t prev_size = MM_GET_SIZE(prev);
 
 	size_t tot_size = prev_size + MM_METADATA_SIZE + size;
-	prev->size = MM_SET_XFREE(tot_size);
+	prev->size = MM_KEEP_PREV(prev, MM_SET_XFREE(tot_size));
 
-	if ((void*)MM_NEXT_HEADER(prev) < mm_heap_end) {
+	if ((void*)MM_NEXT_HEADER(prev) != a->heap_end) {
 		MM_LINK_NEXT_HEADER(prev);
 	}
 
 	*header_ptr = prev;
 }
 
-void mm_coalesce_next(header_t* h) {
+// A block merged with the top chunk becomes the top chunk
+void mm_coalesce_next(arena_t* a, header_t* h) {
 	header_t* next = MM_NEXT_HEADER(h);
-	if ((void*)next >= (void*)mm_heap_end || !MM_IS_FREE(next)) {
+	if ((void*)next == a->heap_end || !MM_IS_FREE(next)) {
 		return;
 	}
 
-	mm_remove_free(next);
+	if (next == a->top)
+		a->top = h;
+	else
+		mm_remove_free(a, next);
 
 	size_t size = MM_GET_SIZE(h);
 	size_t next_size = MM_GET_SIZE(next);
 	size_t tot_size = size + MM_METADATA_SIZE + next_size;
 
-	h->size = MM_SET_XFREE(tot_size);
+	h->size = MM_KEEP_PREV(h, MM_SET_XFREE(tot_size));
 
-	if ((void*)MM_NEXT_HEADER(h) < mm_heap_end) {
+	if ((void*)MM_NEXT_HEADER(h) != a->heap_end) {
 		MM_LINK_NEXT_HEADER(h);
 	}
 }
 
-void mm_shrink_block(header_t* header, size_t size, _Bool is_free) {
+void mm_shrink_block(arena_t* a, header_t* header, size_t size, _Bool is_free) {
 	size_t old_size = MM_GET_SIZE(header);
 	size_t leftover = old_size - size;
 
 	if (leftover >= MM_MIN_BLOCK_SPLIT) {
-		header->size = MM_CLR_FLAGS(size) | (is_free ? MM_FREE_BIT : 0);
+		header->size = MM_KEEP_PREV(header, MM_CLR_FLAGS(size) | (is_free ? MM_FREE_BIT : 0));
 		header_t* new_free = MM_NEXT_HEADER(header);
 
 		size_t new_size = leftover - MM_METADATA_SIZE;
-		new_free->size = MM_SET_XFREE(new_size);
-		new_free->prev = header;
+		new_free->size = MM_SET_XFREE(new_size) | (is_free ? MM_PREV_FREE_BIT : 0);
 
-		if ((void*)MM_NEXT_HEADER(new_free) < mm_heap_end) {
+		if ((void*)MM_NEXT_HEADER(new_free) != a->heap_end) {
 			MM_LINK_NEXT_HEADER(new_free);
 		}
 
-		mm_coalesce_next(new_free);
-		mm_add_to_free(new_free);
+		mm_coalesce_next(a, new_free);
+		if (new_free != a->top)
+			mm_add_to_free(a, new_free);
 	} else {
-		header->size = MM_GET_SIZE(header) | (is_free ? MM_FREE_BIT : 0);
+		header->size = MM_KEEP_PREV(header, MM_GET_SIZE(header) | (is_free ? MM_FREE_BIT : 0));
+
+		if ((void*)MM_NEXT_HEADER(header) != a->heap_end) {
+			MM_LINK_NEXT_HEADER(header);
+		}
 	}
 }
 
-_Bool mm_grow_block(header_t* h, size_t size, _Bool is_free) {
+_Bool mm_grow_block(arena_t* a, header_t* h, size_t size, _Bool is_free) {
 	size_t old_size = MM_GET_SIZE(h);
 	header_t* next = MM_NEXT_HEADER(h);
 
-	if ((void*)next >= (void*)mm_heap_end)
+	if ((void*)next == a->heap_end)
 		return 0;
 
 	if (!MM_IS_FREE(next))
@@ -84,54 +111,318 @@ _Bool mm_grow_block(header_t* h, size_t size, _Bool is_free) {
 	if (free_space < size)
 		return 0;
 
-	mm_remove_free(next);
+	// The top chunk is only ever split, its header has to survive
+	if (next == a->top) {
+		if (free_space - size < MM_METADATA_SIZE)
+			return 0;
+
+		h->size = MM_KEEP_PREV(h, MM_CLR_FLAGS(size) | (is_free ? MM_FREE_BIT : 0));
+		mm_poison_alloc_area((uint8_t*)MM_PAYLOAD(h) + old_size, size - old_size);
+
+		next = MM_NEXT_HEADER(h);
+		next->size = MM_SET_XFREE(free_space - size - MM_METADATA_SIZE);
+		MM_LINK_NEXT_HEADER(h);
+		a->top = next;
+		a->zero_mark = MM_MAX(a->zero_mark, (uint8_t*)next);
+
+		return 1;
+	}
+
+	mm_remove_free(a, next);
 
-	if (free_space - size < MM_MIN_SPLIT) {
+	if (free_space - size < MM_MIN_BLOCK_SPLIT) {
 		// The entire next block gets absorbed
 		mm_poison_alloc_area((void*)next, MM_HEADER_SIZE + next_size);
-		h->size = MM_CLR_FLAGS(free_space);
-		MM_LINK_NEXT_HEADER(h);
+		h->size = MM_KEEP_PREV(h, MM_CLR_FLAGS(free_space) | (is_free ? MM_FREE_BIT : 0));
+
+		if ((void*)MM_NEXT_HEADER(h) != a->heap_end) {
+			MM_LINK_NEXT_HEADER(h);
+		}
 	} else {
 		// The next block gets split
-		h->size = MM_CLR_FLAGS(size);
+		h->size = MM_KEEP_PREV(h, MM_CLR_FLAGS(size) | (is_free ? MM_FREE_BIT : 0));
 		void* poison_start = (uint8_t*)MM_PAYLOAD(h) + old_size;
 		mm_poison_alloc_area(poison_start, size - old_size);
 
 		next = MM_NEXT_HEADER(h);
-		next->size = MM_SET_XFREE(tot_size - size);
-		next->prev = h;
+		next->size = MM_SET_XFREE(tot_size - size) | (is_free ? MM_PREV_FREE_BIT : 0);
 
-		if ((void*)MM_NEXT_HEADER(next) < mm_heap_end) {
+		if ((void*)MM_NEXT_HEADER(next) != a->heap_end) {
 			MM_LINK_NEXT_HEADER(next);
 		}
 
-		mm_add_to_free(next);
+		mm_add_to_free(a, next);
 	}
 
-	h->size |= (is_free ? MM_FREE_BIT : 0);
-
 	return 1;
 }
 
-void* mm_malloc_block(size_t size) {
-	size = MM_ALIGN_UP(size);
+// zeroed, if not NULL, tells whether the payload is known to be all zero
+void* mm_malloc_block(arena_t* a, size_t size, _Bool* zeroed) {
+	size = MM_BLOCK_SIZE(size);
 
-	if (!mm_heap_initialized) {
-		if (!mm_init_heap()) {
+	if (!a->initialized) {
+		if (!mm_init_heap(a)) {
 			return NULL;
 		}
 	}
 
-	header_t* free_block = mm_find_fit(size);
+	header_t* free_block = mm_fast_get(a, size);
+	if (free_block) {
+		if (zeroed)
+			*zeroed = 0;
+		return MM_PAYLOAD(free_block);
+	}
+
+	free_block = mm_find_fit(a, size);
+
+	// A bigger request that misses merges the fast bins, they may add up to a fit
+	if (!free_block && size > MM_OPT(fast_max_size) && mm_consolidate(a))
+		free_block = mm_find_fit(a, size);
+
+	if (free_block) {
+		mm_shrink_block(a, free_block, size, 0);
+		if (zeroed)
+			*zeroed = 0;
+		return MM_PAYLOAD(free_block);
+	}
+
+	uint8_t* zero_mark = a->zero_mark;
 
-	if (!free_block) {
-		if (!mm_grow_heap()) {
+	// Misses are carved from the top chunk, which grows by at least what's missing
+	// The fast bins are merged first, that may be enough to skip growing
+	if (!(free_block = mm_carve_top(a, size))) {
+		if (mm_consolidate(a))
+			return mm_malloc_block(a, size, zeroed);
+
+		size_t top_size = MM_GET_SIZE(a->top);
+		if (size > SIZE_MAX - MM_METADATA_SIZE || !mm_grow_heap(a, size + MM_METADATA_SIZE - top_size))
 			return NULL;
-		} else {
-			return mm_malloc_block(size);
+
+		free_block = mm_carve_top(a, size);
+	}
+
+	if (zeroed)
+		*zeroed = MM_KNOWN_ZERO((uint8_t*)free_block >= zero_mark);
+
+	return MM_PAYLOAD(free_block);
+}
+
+// Allocates a block with room to slide the payload up to the alignment,
+// the block in front of the aligned payload is freed and the tail split off
+void* mm_malloc_aligned_block(arena_t* a, size_t size, size_t align) {
+	size = MM_BLOCK_SIZE(size);
+
+	void* p = mm_malloc_block(a, size + align + MM_MIN_BLOCK_SPLIT, NULL);
+	if (!p)
+		return NULL;
+
+	header_t* h = MM_HEADER(p);
+	uintptr_t aligned = ((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1);
+
+	if (aligned != (uintptr_t)p) {
+		// The lead must be big enough to be a block of its own
+		if (aligned - (uintptr_t)p < MM_MIN_BLOCK_SPLIT)
+			aligned += align;
+
+		size_t lead = aligned - (uintptr_t)p;
+		size_t tot_size = MM_GET_SIZE(h);
+		header_t* ah = MM_HEADER((void*)aligned);
+
+		h->size = MM_KEEP_PREV(h, MM_CLR_FLAGS(lead - MM_METADATA_SIZE));
+		ah->size = MM_CLR_FLAGS(tot_size - lead);
+
+		if ((void*)MM_NEXT_HEADER(ah) != a->heap_end) {
+			MM_LINK_NEXT_HEADER(ah);
+		}
+
+		mm_free_block(a, h);
+		h = ah;
+	}
+
+	mm_shrink_block(a, h, size, 0);
+	return MM_PAYLOAD(h);
+}
+
+// Cuts want blocks of size bytes off the front of a free block taken off its list,
+// what's left past the last one is split off and filed as usual
+static void mm_split_batch(arena_t* a, header_t* h, size_t size, size_t want, void** out) {
+	size_t stride = size + MM_METADATA_SIZE;
+	size_t left = MM_GET_SIZE(h);
+
+	for (size_t i = 0; i + 1 < want; i++) {
+		h->size = MM_CLR_FLAGS(size);
+		out[i] = MM_PAYLOAD(h);
+
+		h = MM_NEXT_HEADER(h);
+		left -= stride;
+	}
+
+	h->size = MM_CLR_FLAGS(left);
+	if ((void*)MM_NEXT_HEADER(h) != a->heap_end) {
+		MM_LINK_NEXT_HEADER(h);
+	}
+
+	mm_shrink_block(a, h, size, 0);
+	out[want - 1] = MM_PAYLOAD(h);
+}
+
+// Allocates up to n blocks of size bytes, each region they're cut from is
+// taken once: the biggest free block holding as many of them as it can, halving
+// down to one, then the top chunk, which only grows by what's still missing
+// Returns how many were allocated, fewer than n only once the heap can't grow
+size_t mm_malloc_block_batch(arena_t* a, size_t size, size_t n, void** out) {
+	size = MM_BLOCK_SIZE(size);
+
+	if (!a->initialized) {
+		if (!mm_init_heap(a)) {
+			return 0;
+		}
+	}
+
+	size_t stride = size + MM_METADATA_SIZE;
+	size_t done = 0;
+
+	while (done < n) {
+		size_t want = MM_MIN(n - done, PTRDIFF_MAX / stride);
+		header_t* h;
+		while (!(h = mm_find_fit(a, want * stride - MM_METADATA_SIZE)) && want > 1)
+			want /= 2;
+
+		if (h) {
+			mm_split_batch(a, h, size, want, out + done);
+			done += want;
+			continue;
+		}
+
+		// No free block holds even one, the fast bins are merged and the free lists tried again
+		if (mm_consolidate(a))
+			continue;
+
+		while (done < n && (h = mm_carve_top(a, size)))
+			out[done++] = MM_PAYLOAD(h);
+		if (done == n)
+			break;
+
+		// The top chunk keeps its header past the last block
+		want = MM_MIN(n - done, PTRDIFF_MAX / stride);
+		if (!mm_grow_heap(a, want * stride - MM_GET_SIZE(a->top)))
+			break;
+	}
+
+	// Out of room, the big growth isn't retried, whatever free blocks are left are taken one by one
+	// and each can still grow the heap by its own size
+	while (done < n) {
+		void* p = mm_malloc_block(a, size, NULL);
+		if (!p)
+			break;
+		out[done++] = p;
+	}
+
+	return done;
+}
+
+// Frees n allocated blocks of the arena, sorted by address
+// Blocks that are neighbours are merged first, so each run of them is
+// coalesced with the heap and filed once
+void mm_free_block_batch(arena_t* a, void** ptrs, size_t n) {
+	for (size_t i = 0; i < n;) {
+		header_t* h = MM_HEADER(ptrs[i++]);
+		size_t size = MM_GET_SIZE(h);
+
+		while (i < n && MM_HEADER(ptrs[i]) == MM_NEXT_HEADER(h)) {
+			size += MM_METADATA_SIZE + MM_GET_SIZE(MM_HEADER(ptrs[i]));
+			h->size = MM_KEEP_PREV(h, MM_CLR_FLAGS(size));
+			i++;
+		}
+
+		mm_poison_free(MM_PAYLOAD(h));
+		mm_free_block(a, h);
+	}
+}
+
+// Splits an allocated block of size bytes off the front of the top chunk
+header_t* mm_carve_top(arena_t* a, size_t size) {
+	header_t* h = a->top;
+	size_t top_size = MM_GET_SIZE(h);
+
+	if (top_size < size + MM_METADATA_SIZE)
+		return NULL;
+
+	h->size = MM_KEEP_PREV(h, MM_CLR_FLAGS(size));
+
+	header_t* top = MM_NEXT_HEADER(h);
+	top->size = MM_SET_XFREE(top_size - size - MM_METADATA_SIZE);
+	a->top = top;
+	a->zero_mark = MM_MAX(a->zero_mark, (uint8_t*)top);
+
+	return h;
+}
+
+// Marks the block free, merges it with free neighbours and files it
+void mm_free_block(arena_t* a, header_t* h) {
+	h->size = MM_SET_FREE(h->size);
+	mm_coalesce_prev(a, &h);
+	mm_coalesce_next(a, h);
+
+	if (h != a->top) {
+		MM_LINK_NEXT_HEADER(h);
+		mm_add_to_free(a, h);
+	} else {
+		// Half the threshold is kept, so a heap that is regrown right away
+		// doesn't trim and grow on every cycle
+		size_t threshold = MM_OPT(trim_threshold);
+		if (threshold && MM_GET_SIZE(h) >= threshold)
+			mm_trim_top(a, MM_MAX(MM_OPT(trim_pad), threshold / 2));
+	}
+}
+
+// Holds an allocated block in its fast bin instead of freeing it
+// Returns 0 if its size has no fast bin
+_Bool mm_fast_put(arena_t* a, header_t* h) {
+	size_t size = MM_GET_SIZE(h);
+	if (!size || size > MM_OPT(fast_max_size))
+		return 0;
+
+	header_t** bin = &a->fast_bins[mm_fast_idx(size)];
+
+#ifdef MM_DEBUG
+	for (header_t* cur = *bin; cur; cur = *(header_t**)MM_PAYLOAD(cur)) {
+		if (cur == h) {
+			fprintf(stderr, "Double free detected\n");
+			fflush(stderr);
+			MM_ABORT();
 		}
 	}
+#endif
+
+	*(header_t**)MM_PAYLOAD(h) = *bin;
+	*bin = h;
+	a->fast_blocks++;
+	a->fast_bytes += size + MM_METADATA_SIZE;
+
+	return 1;
+}
+
+// Frees every held block, so they merge with their neighbours and get filed
+// Returns 0 if the fast bins were empty
+_Bool mm_consolidate(arena_t* a) {
+	if (!a->fast_blocks)
+		return 0;
 
-	mm_shrink_block(free_block, size, 0);
-	return (void*)((uint8_t*)free_block + MM_HEADER_SIZE);
+	for (size_t i = 0; i < MM_FAST_BINS; i++) {
+		header_t* h = a->fast_bins[i];
+		a->fast_bins[i] = NULL;
+
+		while (h) {
+			header_t* next = *(header_t**)MM_PAYLOAD(h);
+			mm_free_block(a, h);
+			h = next;
+		}
+	}
+
+	a->fast_blocks = 0;
+	a->fast_bytes = 0;
+
+	return 1;
 }
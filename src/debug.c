@@ -4,9 +4,14 @@
 #include <stdio.h>
 #include <string.h>
 
-void mm_debug_test(void) {
-	mm_heap_check();
-	mm_free_check();
+void mm_debug_test(arena_t* a) {
+	// Slab allocations don't initialize the heap
+	if (!a->initialized)
+		return;
+
+	mm_heap_check(a);
+	mm_free_check(a);
+	mm_fast_check(a);
 }
 
 #ifdef MM_ENABLE_CANARIES
@@ -36,7 +41,7 @@ inline void mm_poison_free(void* p) {
 	s -= sizeof(void*);
 #endif
 
-	if (s == 0 || (s > mm_heap_size && !MM_IS_MMAP(h))) {
+	if (s == 0 || (!MM_IS_MMAP(h) && s > mm_arena_of(h)->heap_size)) {
 		fprintf(stderr, "Invalid block size %zu\n", s);
 		MM_ABORT();
 	}
@@ -47,7 +52,7 @@ inline void mm_poison_alloc(void* p) {
 	header_t* h = MM_HEADER(p);
 	size_t s = MM_GET_SIZE(h);
 
-	if (s == 0 || (s > mm_heap_size && !MM_IS_MMAP(h))) {
+	if (s == 0 || (!MM_IS_MMAP(h) && s > mm_arena_of(h)->heap_size)) {
 		fprintf(stderr, "Invalid block size %zu\n", s);
 		fprintf(stderr, "%p\n", p);
 		MM_ABORT();
@@ -82,30 +87,79 @@ inline void mm_poison_free_area(void* p, size_t s) {}
 inline void mm_poison_alloc_area(void* p, size_t s) {}
 #endif
 
-void mm_heap_check(void) {
-	header_t* cur = (header_t*)mm_heap_start;
+void mm_heap_check(arena_t* a) {
+	header_t* cur = (header_t*)a->heap_start;
 	header_t* next;
+	assert(!MM_IS_PREV_FREE(cur));
 	for (;;) {
 		size_t size = MM_GET_SIZE(cur);
 
 		assert((uintptr_t)cur % MM_ALIGNMENT == 0);
 		assert(size % MM_ALIGNMENT == 0);
 		next = MM_NEXT_HEADER(cur);
-		if ((void*)next >= mm_heap_end) {
+		if ((void*)next == a->heap_end) {
+			assert(cur == a->top && MM_IS_FREE(cur));
 			break;
 		}
 
-		assert(next->prev == cur);
+		// The boundary tag must describe cur, and free blocks never touch
+		assert(MM_IS_PREV_FREE(next) == MM_IS_FREE(cur));
+		if (MM_IS_FREE(cur)) {
+			assert(next->prev_foot == size);
+			assert(!MM_IS_FREE(next));
+		}
+
+		// A segment's first block has nothing before it
+		if (MM_IS_FENCE(next)) {
+			assert(cur != a->top);
+			next = *MM_FENCE_LINK(next);
+			assert(!MM_IS_PREV_FREE(next));
+		}
+
 		cur = next;
 	}
 }
 
-void mm_free_check(void) {
+void mm_free_check(arena_t* a) {
+	size_t bytes[MM_FL_COUNT] = {0};
+	size_t blocks = 0;
+
 	for (size_t i = 0; i < MM_BIN_COUNT; i++) {
-		header_t* cur = mm_free_lists[i];
+		header_t* cur = a->free_lists[i];
+		size_t fl = i / MM_SL_COUNT;
+		size_t sl = i % MM_SL_COUNT;
+
+		// The bitmaps must match the lists
+		assert(!!cur == !!(a->sl_map[fl] & ((sl_map_t)1 << sl)));
+		assert(!!a->sl_map[fl] == !!(a->fl_map & ((fl_map_t)1 << fl)));
+
 		while (cur) {
-			assert(MM_IS_FREE(cur));
+			assert(MM_IS_FREE(cur) && cur != a->top);
+			assert(mm_idx_from_size(MM_GET_SIZE(cur)) == i);
+			bytes[fl] += MM_GET_SIZE(cur) + MM_METADATA_SIZE;
+			blocks++;
 			cur = MM_GET_NEXT(cur);
 		}
 	}
+
+	// The statistics must match the lists
+	assert(blocks == a->free_blocks);
+	assert(!memcmp(bytes, a->free_bytes, sizeof(bytes)));
+}
+
+void mm_fast_check(arena_t* a) {
+	size_t bytes = 0;
+	size_t blocks = 0;
+
+	for (size_t i = 0; i < MM_FAST_BINS; i++) {
+		for (header_t* cur = a->fast_bins[i]; cur; cur = *(header_t**)MM_PAYLOAD(cur)) {
+			// Held blocks stay allocated, each in the bin of its size
+			assert(!MM_IS_FREE(cur) && !MM_IS_MMAP(cur));
+			assert(MM_GET_SIZE(cur) == (i + 1) * MM_ALIGNMENT);
+			bytes += MM_GET_SIZE(cur) + MM_METADATA_SIZE;
+			blocks++;
+		}
+	}
+
+	assert(blocks == a->fast_blocks && bytes == a->fast_bytes);
 }
@@ -1,55 +1,119 @@
 #include "interface.h"
 #include <stdio.h>
 
-header_t* mm_free_lists[MM_BIN_COUNT] = {0};
-free_map_t mm_free_map = 0;
+static inline size_t mm_log2(size_t s) { return sizeof(size_t) * 8 - 1 - __builtin_clzll(s); }
 
+// Index of the list holding blocks of size s
 size_t mm_idx_from_size(size_t s) {
-	size_t bits = sizeof(size_t) * 8;
-	size_t units = s / MM_BIN_BASE;
-	size_t i = bits - 1 - __builtin_clzll(units);
+	if (s < MM_SMALL_BLOCK)
+		return s / MM_ALIGNMENT;
 
-	if (i >= MM_BIN_COUNT)
+	size_t log = mm_log2(s);
+	size_t fl = log - mm_log2(MM_SMALL_BLOCK) + 1;
+	size_t sl = (s >> (log - MM_SL_BITS)) & (MM_SL_COUNT - 1);
+
+	if (fl >= MM_FL_COUNT)
 		return MM_BIN_COUNT - 1;
 
-	return i;
+	return fl * MM_SL_COUNT + sl;
 }
 
+// Smallest block size held by list i
 size_t mm_size_from_idx(size_t i) {
-	if (i >= MM_BIN_COUNT)
-		i = MM_BIN_COUNT - 1;
-	return MM_BIN_BASE << i;
+	size_t fl = i / MM_SL_COUNT;
+	size_t sl = i % MM_SL_COUNT;
+
+	if (fl == 0)
+		return sl * MM_ALIGNMENT;
+
+	size_t base = MM_SMALL_BLOCK << (fl - 1);
+	return base + sl * (base >> MM_SL_BITS);
+}
+
+// Index of the first list whose blocks all fit s, sizes past the last
+// list's lower bound land in the last list, which has to be scanned
+static size_t mm_idx_from_request(size_t s) {
+	if (s >= MM_SMALL_BLOCK) {
+		size_t round = ((size_t)1 << (mm_log2(s) - MM_SL_BITS)) - 1;
+		if (s + round > s)
+			s += round;
+	}
+
+	return mm_idx_from_size(s);
+}
+
+static inline void mm_bin_set(arena_t* a, size_t i) {
+	a->sl_map[i / MM_SL_COUNT] |= (sl_map_t)1 << (i % MM_SL_COUNT);
+	a->fl_map |= (fl_map_t)1 << (i / MM_SL_COUNT);
+}
+
+static inline void mm_bin_clear(arena_t* a, size_t i) {
+	size_t fl = i / MM_SL_COUNT;
+
+	a->sl_map[fl] &= (sl_map_t)~((sl_map_t)1 << (i % MM_SL_COUNT));
+	if (!a->sl_map[fl])
+		a->fl_map &= ~((fl_map_t)1 << fl);
+}
+
+// First non-empty list at or after i, MM_BIN_COUNT if there is none
+static size_t mm_next_bin(arena_t* a, size_t i) {
+	size_t fl = i / MM_SL_COUNT;
+	sl_map_t sl_mask = a->sl_map[fl] & (sl_map_t)((sl_map_t)-1 << (i % MM_SL_COUNT));
+
+	if (sl_mask)
+		return fl * MM_SL_COUNT + __builtin_ctz(sl_mask);
+
+	fl_map_t fl_mask = fl + 1 < MM_FL_COUNT ? a->fl_map & ((fl_map_t)-1 << (fl + 1)) : 0;
+	if (!fl_mask)
+		return MM_BIN_COUNT;
+
+	fl = __builtin_ctz(fl_mask);
+	return fl * MM_SL_COUNT + __builtin_ctz(a->sl_map[fl]);
+}
+
+static inline void mm_free_account(arena_t* a, size_t i, size_t size, _Bool add) {
+	size_t bytes = size + MM_METADATA_SIZE;
+
+	if (add) {
+		a->free_bytes[i / MM_SL_COUNT] += bytes;
+		a->free_blocks++;
+	} else {
+		a->free_bytes[i / MM_SL_COUNT] -= bytes;
+		a->free_blocks--;
+	}
 }
 
 #ifdef MM_SAFE_ADD
-void mm_add_to_free(header_t* h) {
+void mm_add_to_free(arena_t* a, header_t* h) {
 	size_t s = MM_GET_SIZE(h);
 	size_t i = mm_idx_from_size(s);
-	MM_SET_NEXT(h, mm_free_lists[i]);
-	mm_free_lists[i] = h;
-	mm_free_map |= MM_BIN_BIT(i);
+	MM_SET_NEXT(h, a->free_lists[i]);
+	a->free_lists[i] = h;
+	mm_bin_set(a, i);
+	mm_free_account(a, i, s, 1);
 }
 #else
-void mm_add_to_free(header_t* h) {
+void mm_add_to_free(arena_t* a, header_t* h) {
 	size_t s = MM_GET_SIZE(h);
 	size_t i = mm_idx_from_size(s);
-	header_t* old_head = mm_free_lists[i];
+	header_t* old_head = a->free_lists[i];
 	if (old_head) {
-		MM_SET_PREV(mm_free_lists[i], h);
+		MM_SET_PREV(a->free_lists[i], h);
 	}
 
-	MM_SET_NEXT(h, mm_free_lists[i]);
+	MM_SET_NEXT(h, a->free_lists[i]);
 	MM_SET_PREV(h, NULL);
-	mm_free_lists[i] = h;
-	mm_free_map |= MM_BIN_BIT(i);
+	a->free_lists[i] = h;
+	mm_bin_set(a, i);
+	mm_free_account(a, i, s, 1);
 }
 #endif
 
 #ifdef MM_SAFE_REMOVE
-_Bool mm_remove_free(header_t* h) {
+_Bool mm_remove_free(arena_t* a, header_t* h) {
 	size_t s = MM_GET_SIZE(h);
 	size_t i = mm_idx_from_size(s);
-	header_t** cur = &mm_free_lists[i];
+	header_t** cur = &a->free_lists[i];
 
 	while (*cur && *cur != h)
 		cur = MM_GET_NEXT_PTR(*cur);
@@ -59,23 +123,27 @@ _Bool mm_remove_free(header_t* h) {
 
 	*cur = MM_GET_NEXT(*cur);
 
-	if (!mm_free_lists[i])
-		mm_free_map &= ~MM_BIN_BIT(i);
+	if (!a->free_lists[i])
+		mm_bin_clear(a, i);
 
+	mm_free_account(a, i, s, 0);
 	return 1;
 }
 #else
-_Bool mm_remove_free(header_t* h) {
+_Bool mm_remove_free(arena_t* a, header_t* h) {
 	header_t* prev = MM_GET_PREV(h);
 	header_t* next = MM_GET_NEXT(h);
+	size_t s = MM_GET_SIZE(h);
+	size_t i = mm_idx_from_size(s);
+
+	mm_free_account(a, i, s, 0);
 
 	if (!prev) {
-		size_t i = mm_idx_from_size(MM_GET_SIZE(h));
-		mm_free_lists[i] = next;
+		a->free_lists[i] = next;
 		if (next) {
 			MM_SET_PREV(next, NULL);
 		} else {
-			mm_free_map &= ~MM_BIN_BIT(i);
+			mm_bin_clear(a, i);
 		}
 	} else {
 		MM_SET_NEXT(prev, next);
@@ -88,41 +156,31 @@ _Bool mm_remove_free(header_t* h) {
 }
 #endif
 
-header_t* mm_find_fit(size_t s) {
-	size_t i = mm_idx_from_size(s);
-	header_t** cur;
-
-	while (i < MM_BIN_COUNT) {
-		free_map_t mask = mm_free_map & ((free_map_t)-1 << i);
-		if (!mask)
-			return NULL;
-		i = __builtin_ctz(mask);
-
-		cur = &mm_free_lists[i];
-
-		while (*cur) {
-			if (MM_GET_SIZE(*cur) >= s)
-				break;
+// Good-fit: the head of the first non-empty list whose blocks all fit,
+// only the last list, whose sizes are unbounded, is walked
+// The scan length is the number of blocks looked at, 0 when every list was empty
+header_t* mm_find_fit(arena_t* a, size_t s) {
+	size_t i = mm_next_bin(a, mm_idx_from_request(s));
+	if (i == MM_BIN_COUNT) {
+		mm_latency_scan(0);
+		return NULL;
+	}
 
-			cur = MM_GET_NEXT_PTR(*cur);
-		}
+	header_t* ret = a->free_lists[i];
+	size_t scanned = 1;
 
-		if (*cur) {
-			break;
+	if (i == MM_BIN_COUNT - 1) {
+		while (ret && MM_GET_SIZE(ret) < s) {
+			ret = MM_GET_NEXT(ret);
+			scanned += ret != NULL;
 		}
-
-		i++;
 	}
 
-	if (!*cur) {
+	mm_latency_scan(scanned);
+	if (!ret)
 		return NULL;
-	}
-
-	header_t* ret = *cur;
-	mm_remove_free(ret);
 
-	if (!mm_free_lists[i])
-		mm_free_map &= ~MM_BIN_BIT(i);
+	mm_remove_free(a, ret);
 
 	return ret;
 }
@@ -4,148 +4,662 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
-void* mm_heap_start;
-void* mm_heap_end;
-size_t mm_heap_size = 0;
-_Bool mm_heap_initialized = 0;
+arena_t mm_main_arena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+arena_t* mm_arenas[MM_ARENA_COUNT] = {&mm_main_arena};
+
+static pthread_mutex_t mm_arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mm_fork_once = PTHREAD_ONCE_INIT;
+static size_t mm_next_arena = 0;
+static MM_TLS arena_t* mm_thread_arena;
 
 #ifdef MM_DEBUG
 _Static_assert(!(MM_ALIGNMENT & 0x1), "MM_ALIGNMENT must be even");
 #endif
 
-// Allocates the first INITIAL_HEAP_SIZE bytes
-_Bool mm_init_heap(void) {
-	mm_heap_size = MM_INITIAL_HEAP_SIZE;
-	uintptr_t brk = (uintptr_t)sbrk(0);
+// The forking thread keeps every lock across fork() so the child
+// never inherits a heap that is halfway through an update
+static void mm_fork_prepare(void) {
+	pthread_mutex_lock(&mm_arenas_lock);
+	for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+		if (mm_arenas[i])
+			MM_LOCK(mm_arenas[i]);
+	}
+	pthread_mutex_lock(&mm_slab_lock);
+	pthread_mutex_lock(&mm_mmap_cache_lock);
+}
+
+static void mm_fork_release(void) {
+	pthread_mutex_unlock(&mm_mmap_cache_lock);
+	pthread_mutex_unlock(&mm_slab_lock);
+	for (size_t i = MM_ARENA_COUNT; i-- > 0;) {
+		if (mm_arenas[i])
+			MM_UNLOCK(mm_arenas[i]);
+	}
+	pthread_mutex_unlock(&mm_arenas_lock);
+}
+
+static void mm_fork_register(void) { pthread_atfork(mm_fork_prepare, mm_fork_release, mm_fork_release); }
+
+// Reserves len bytes of address space aligned to align, none of it is usable yet
+// Private PROT_NONE mappings aren't charged, mm_protect charges the pages it opens up
+static uint8_t* mm_reserve(size_t len, size_t align) {
+	size_t over = len + align;
+	if (over < len)
+		return NULL;
+
+	MM_COUNT(mmap_calls, 1);
+	uint8_t* map = mmap(NULL, over, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == (void*)-1)
+		return NULL;
+
+	uint8_t* base = (uint8_t*)(((uintptr_t)map + align - 1) & ~(uintptr_t)(align - 1));
+	if (base > map) {
+		MM_COUNT(munmap_calls, 1);
+		munmap(map, base - map);
+	}
+	MM_COUNT(munmap_calls, 1);
+	munmap(base + len, map + over - base - len);
+
+	return base;
+}
 
-	if (brk == (uintptr_t)-1) {
+// Commits the pages of [from, to) of a reservation
+static _Bool mm_protect(uintptr_t from, uintptr_t to) {
+	to = MM_PAGE_ALIGN(to);
+	if (to <= from)
+		return 1;
+
+	MM_COUNT(mprotect_calls, 1);
+	if (mprotect((void*)from, to - from, PROT_READ | PROT_WRITE) == -1) {
 #ifdef MM_DEBUG
-		perror("sbrk");
+		perror("mprotect");
 #endif
 		return 0;
 	}
 
-	size_t mis = brk & (MM_ALIGNMENT - 1);
-	if (mis) {
-		if (sbrk(MM_ALIGNMENT - mis) == (void*)-1) {
+	return 1;
+}
+
+// Commits the arena's reservation up to end
+static _Bool mm_commit(arena_t* a, uintptr_t end) {
+	end = MM_PAGE_ALIGN(end);
+	if (end <= (uintptr_t)a->commit_end)
+		return 1;
+
+	if (!mm_protect((uintptr_t)a->commit_end, end))
+		return 0;
+
+	a->commit_end = (void*)end;
+	return 1;
+}
+
+// Gives back the pages of the arena's reservation from the page at from on
+// Mapping PROT_NONE over them drops both the memory and the commit charge
+static _Bool mm_decommit(arena_t* a, uintptr_t from) {
+	uintptr_t to = (uintptr_t)a->commit_end;
+	if (to <= from)
+		return 1;
+
+	MM_COUNT(mmap_calls, 1);
+	if (mmap((void*)from, to - from, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == (void*)-1) {
 #ifdef MM_DEBUG
-			perror("sbrk");
+		perror("mmap");
 #endif
-			return 0;
+		return 0;
+	}
+
+	a->commit_end = (void*)from;
+	return 1;
+}
+
+typedef struct mm_segment {
+	uintptr_t start;
+	uintptr_t end;
+} mm_segment_t;
+
+// The main heap's segments, they're only ever added, under the main arena's lock
+static mm_segment_t mm_segments[MM_MAX_SEGMENTS];
+static size_t mm_segment_count = 0;
+
+// Reserves a segment of the main heap and commits its first commit bytes
+// The reservation is halved while the address space has no room for it,
+// down to what the commit and a fence need
+// len is set to the size of the reservation
+static uint8_t* mm_add_segment(size_t commit, size_t* len) {
+	size_t count = mm_segment_count;
+	if (count == MM_MAX_SEGMENTS)
+		return NULL;
+
+	size_t min = MM_HUGE_ALIGN(commit + MM_FENCE_ROOM);
+	size_t n = MM_MAX(MM_OPT(heap_reserve), min);
+	uint8_t* base;
+
+	while (!(base = mm_reserve(n, MM_HUGE_PAGE_SIZE))) {
+		if (n == min) {
+#ifdef MM_DEBUG
+			perror("mmap");
+#endif
+			return NULL;
 		}
+		n = MM_MAX(MM_HUGE_ALIGN(n / 2), min);
+	}
+
+	if (!mm_protect((uintptr_t)base, (uintptr_t)base + commit)) {
+		MM_COUNT(munmap_calls, 1);
+		munmap(base, n);
+		return NULL;
 	}
 
-	mm_heap_start = sbrk(0);
+	mm_segments[count] = (mm_segment_t){(uintptr_t)base, (uintptr_t)base + n};
+	__atomic_store_n(&mm_segment_count, count + 1, __ATOMIC_RELEASE);
+	MM_COUNT(segments, 1);
 
-	if (mm_heap_start == (void*)-1 || sbrk(mm_heap_size) == (void*)-1) {
+	*len = n;
+	return base;
+}
+
+// Reserves a region aligned to its own size, so blocks can find their arena by masking
+// Only the arena's header is committed, the heap is committed as it grows
+static arena_t* mm_arena_create(void) {
+	uint8_t* base = mm_reserve(MM_ARENA_REGION_SIZE, MM_ARENA_REGION_SIZE);
+	if (!base) {
 #ifdef MM_DEBUG
-		perror("sbrk");
+		perror("mmap");
 #endif
-		return 0;
+		return NULL;
 	}
 
-	mm_heap_end = sbrk(0);
+	uintptr_t header_end = MM_PAGE_ALIGN((uintptr_t)base + sizeof(arena_t));
+	if (!mm_protect((uintptr_t)base, header_end)) {
+		MM_COUNT(munmap_calls, 1);
+		munmap(base, MM_ARENA_REGION_SIZE);
+		return NULL;
+	}
 
-	size_t payload = mm_heap_size - MM_METADATA_SIZE;
+	arena_t* a = (arena_t*)base;
+	pthread_mutex_init(&a->lock, NULL);
+	a->heap_start = base + MM_ALIGN_UP(sizeof(arena_t));
+	a->region_end = base + MM_ARENA_REGION_SIZE;
+	a->commit_end = (void*)header_end;
 
-	header_t* h = (header_t*)mm_heap_start;
-	h->size = MM_SET_XFREE(payload);
-	h->prev = NULL;
+	return a;
+}
+
+// Returns the calling thread's arena, assigning one round-robin on first use
+arena_t* mm_arena_get(void) {
+	if (mm_thread_arena)
+		return mm_thread_arena;
+
+	pthread_once(&mm_fork_once, mm_fork_register);
+
+	size_t i = __atomic_fetch_add(&mm_next_arena, 1, __ATOMIC_RELAXED) % MM_ARENA_COUNT;
+
+	pthread_mutex_lock(&mm_arenas_lock);
+	if (!mm_arenas[i])
+		__atomic_store_n(&mm_arenas[i], mm_arena_create(), __ATOMIC_RELEASE);
+	arena_t* a = mm_arenas[i] ? mm_arenas[i] : &mm_main_arena;
+	pthread_mutex_unlock(&mm_arenas_lock);
+
+	mm_thread_arena = a;
+	return a;
+}
+
+// The segments are read without the main arena's lock,
+// a block is only handed out once its segment is published
+arena_t* mm_arena_of(header_t* h) {
+	size_t count = __atomic_load_n(&mm_segment_count, __ATOMIC_ACQUIRE);
+	for (size_t i = 0; i < count; i++) {
+		if ((uintptr_t)h - mm_segments[i].start < mm_segments[i].end - mm_segments[i].start)
+			return &mm_main_arena;
+	}
+
+	return (arena_t*)((uintptr_t)h & ~(uintptr_t)(MM_ARENA_REGION_SIZE - 1));
+}
+
+// Whether p lies in the arena's heap, the main heap spans all of its segments
+_Bool mm_in_heap(arena_t* a, void* p) {
+	if (a == &mm_main_arena)
+		return mm_arena_of(p) == a;
+
+	return p >= a->heap_start && p < __atomic_load_n(&a->heap_end, __ATOMIC_ACQUIRE);
+}
+
+// Asks for huge pages over [from, to), counting them towards the arena's, if any
+static _Bool mm_advise_huge(arena_t* a, uintptr_t from, uintptr_t to) {
+	if (to <= from)
+		return 0;
+
+	MM_COUNT(madvise_calls, 1);
+	if (madvise((void*)from, to - from, MADV_HUGEPAGE) == -1) {
 #ifdef MM_DEBUG
-	h->prev_free = NULL;
-	h->next_free = NULL;
+		perror("madvise");
 #endif
-	MM_SET_NEXT(h, NULL);
-	MM_SET_PREV(h, NULL);
-	mm_add_to_free(h);
+		return 0;
+	}
+
+	MM_COUNT(thp_bytes, to - from);
+	if (a)
+		a->thp_bytes += to - from;
+	return 1;
+}
+
+// Allocates the initial heap, of the main heap's first segment or of the arena's region
+// With huge pages the heap ends on a huge page boundary, a region's heap
+// starts past the arena's header, so the first huge page is shared with it
+_Bool mm_init_heap(arena_t* a) {
+	mm_init_options();
+	_Bool thp = MM_OPT(thp);
+	a->heap_size = MM_OPT(initial_heap_size);
+
+	if (a == &mm_main_arena) {
+		if (thp)
+			a->heap_size = MM_HUGE_ALIGN(a->heap_size);
+
+		size_t len;
+		uint8_t* base = mm_add_segment(a->heap_size, &len);
+		if (!base)
+			return 0;
+
+		a->heap_start = base;
+		a->region_end = base + len - MM_FENCE_ROOM;
+		a->commit_end = (void*)MM_PAGE_ALIGN((uintptr_t)base + a->heap_size);
+	} else {
+		if (thp) {
+			uintptr_t start = (uintptr_t)a->heap_start;
+			a->heap_size = MM_HUGE_ALIGN(start + a->heap_size) - start;
+		}
+		if (!mm_commit(a, (uintptr_t)a->heap_start + a->heap_size))
+			return 0;
+	}
+
+	if (thp) {
+		uintptr_t start = (uintptr_t)a->heap_start & ~(uintptr_t)(MM_HUGE_PAGE_SIZE - 1);
+		mm_advise_huge(a, start, (uintptr_t)a->heap_start + a->heap_size);
+	}
+
+	size_t payload = a->heap_size - MM_METADATA_SIZE;
+
+	// The whole initial heap starts out as the top chunk
+	header_t* h = (header_t*)a->heap_start;
+	h->size = MM_SET_XFREE(payload);
+	a->top = h;
+	a->zero_mark = (uint8_t*)h;
+
+	__atomic_store_n(&a->heap_end, (uint8_t*)a->heap_start + a->heap_size, __ATOMIC_RELEASE);
 
 	mm_poison_free(MM_PAYLOAD(h));
-	mm_heap_initialized = 1;
+	a->initialized = 1;
+
+	return 1;
+}
 
+// Extends the heap by n bytes of its reservation
+static _Bool mm_extend_heap(arena_t* a, size_t n) {
+	if ((size_t)((uint8_t*)a->region_end - (uint8_t*)a->heap_end) < n)
+		return 0;
+
+	if (!mm_commit(a, (uintptr_t)a->heap_end + n))
+		return 0;
+
+	__atomic_store_n(&a->heap_end, (uint8_t*)a->heap_end + n, __ATOMIC_RELEASE);
 	return 1;
 }
 
-// Doubles heap size
-_Bool mm_grow_heap(void) {
-	if (mm_heap_size > SIZE_MAX / 2)
+// Continues the main heap in a new segment of at least n bytes past the top chunk's
+// The old top chunk becomes a plain free block and a fence ends its segment
+static _Bool mm_new_segment(arena_t* a, size_t n) {
+	header_t* old_top = a->top;
+	size_t top_size = MM_GET_SIZE(old_top);
+	_Bool thp = MM_OPT(thp);
+
+	// The new top chunk holds what the old one did, and the request on top
+	size_t len = n + top_size + MM_METADATA_SIZE;
+	len = thp || len >= MM_HUGE_PAGE_SIZE ? MM_HUGE_ALIGN(len) : MM_PAGE_ALIGN(len);
+
+	uint8_t* old_end = a->heap_end;
+	if (!mm_commit(a, (uintptr_t)old_end + MM_FENCE_ROOM))
 		return 0;
 
-	void* old_end = mm_heap_end;
-	if (sbrk(mm_heap_size) == (void*)-1) {
+	size_t seg_len;
+	uint8_t* base = mm_add_segment(len, &seg_len);
+	if (!base)
+		return 0;
+
+	header_t* fence = (header_t*)old_end;
+	fence->size = MM_FENCE_BIT;
+	*MM_FENCE_LINK(fence) = (header_t*)base;
+
+	// A top chunk too small to be filed stays allocated for good
+	if (top_size >= MM_MIN_SPLIT)
+		mm_add_to_free(a, old_top);
+	else
+		old_top->size = MM_CLR_FREE(old_top->size);
+	MM_LINK_NEXT_HEADER(old_top);
+
+	a->heap_size += len;
+
+	header_t* top = (header_t*)base;
+	top->size = MM_SET_XFREE(len - MM_METADATA_SIZE);
+	mm_write_canary(top);
+	mm_poison_free(MM_PAYLOAD(top));
+
+	a->top = top;
+	a->zero_mark = (uint8_t*)top;
+	a->region_end = base + seg_len - MM_FENCE_ROOM;
+	a->commit_end = (void*)MM_PAGE_ALIGN((uintptr_t)base + len);
+	__atomic_store_n(&a->heap_end, base + len, __ATOMIC_RELEASE);
+
+	if (thp)
+		mm_advise_huge(a, (uintptr_t)base, (uintptr_t)base + len);
+
+	MM_COUNT(grows, 1);
+	return 1;
+}
+
+// Grows the heap by the geometric step, capped at the maximum step,
+// or by the request if it's bigger, the new end is rounded to a page,
+// or to a huge page for steps of at least one
+// The new space is appended to the top chunk, so no block is visited
+// Once the main heap's segment can't hold the request, it moves to a new one
+_Bool mm_grow_heap(arena_t* a, size_t request) {
+	MM_LATENCY_SCOPE(MM_LATENCY_GROW_HEAP);
+	size_t factor = MM_OPT(growth_factor);
+	size_t step = a->heap_size > SIZE_MAX / factor ? SIZE_MAX : a->heap_size * (factor - 1);
+	step = MM_MIN(step, MM_OPT(growth_max_step));
+
+	size_t n = MM_MAX(request, step);
+	_Bool thp = MM_OPT(thp);
+	size_t align = thp || n >= MM_HUGE_PAGE_SIZE ? MM_HUGE_PAGE_SIZE : (size_t)MM_PAGE_SIZE;
+	uintptr_t old_end = (uintptr_t)a->heap_end;
+
+	if (n > PTRDIFF_MAX - align || old_end + n + align < old_end)
+		return 0;
+
+	n = ((old_end + n + align - 1) & ~(uintptr_t)(align - 1)) - old_end;
+
+	// The last bit of a reservation is still used as long as the request fits
+	size_t room = (uintptr_t)a->region_end - old_end;
+	if (n > room) {
+		if (request > room && a == &mm_main_arena)
+			return mm_new_segment(a, n);
+		n = room;
+	}
+
+	if (n < request || !mm_extend_heap(a, n))
+		return 0;
+
+	// The last partial huge page of a heap that was grown without them stays small
+	if (thp)
+		mm_advise_huge(a, MM_HUGE_ALIGN(old_end), old_end + n);
+
+	header_t* top = a->top;
+	top->size = MM_SET_XFREE(MM_GET_SIZE(top) + n);
+
+	mm_poison_free_area((uint8_t*)old_end - MM_CANARY_SIZE, n);
+	mm_write_canary(top);
+
+	a->heap_size += n;
+	MM_COUNT(grows, 1);
+	return 1;
+}
+
+// Gives back the whole pages at the end of the top chunk, keeping pad bytes of it
+// With huge pages only whole huge pages are given back
+size_t mm_trim_top(arena_t* a, size_t pad) {
+	header_t* top = a->top;
+	size_t top_size = MM_GET_SIZE(top);
+	size_t page = MM_OPT(thp) ? MM_HUGE_PAGE_SIZE : (size_t)MM_PAGE_SIZE;
+
+	if (top_size <= pad)
+		return 0;
+
+	size_t n = (top_size - pad) & ~(page - 1);
+	if (!n)
+		return 0;
+
+	uint8_t* new_end = (uint8_t*)a->heap_end - n;
+
+	// A region's heap isn't page aligned, the partial page stays
+	uintptr_t from = ((uintptr_t)new_end + page - 1) & ~(page - 1);
+	if (!mm_decommit(a, from))
+		return 0;
+
+	top->size = MM_SET_XFREE(top_size - n);
+	mm_write_canary(top);
+
+	__atomic_store_n(&a->heap_end, new_end, __ATOMIC_RELEASE);
+	a->heap_size -= n;
+	MM_COUNT(trims, 1);
+
+	// Advised space is always at the end of the heap, growth advises it again
+	size_t thp = MM_MIN(n, a->thp_bytes);
+	a->thp_bytes -= thp;
+	MM_COUNT(thp_bytes, -thp);
+
+	return n;
+}
+
+// Decommits the whole pages inside a free block, past its free list links
+// With huge pages only whole huge pages are decommitted, so none gets split
+static size_t mm_decommit_free(header_t* h) {
+	size_t page = MM_OPT(thp) ? MM_HUGE_PAGE_SIZE : (size_t)MM_PAGE_SIZE;
+	uintptr_t from = ((uintptr_t)MM_PAYLOAD(h) + MM_MIN_PAYLOAD + page - 1) & ~(page - 1);
+	uintptr_t to = ((uintptr_t)MM_PAYLOAD(h) + MM_GET_SIZE(h)) & ~(page - 1);
+
+	if (to <= from)
+		return 0;
+
+	MM_COUNT(madvise_calls, 1);
+	if (madvise((void*)from, to - from, MADV_DONTNEED) == -1) {
 #ifdef MM_DEBUG
-		perror("sbrk");
+		perror("madvise");
 #endif
 		return 0;
 	}
 
-	mm_heap_end = sbrk(0);
+	return to - from;
+}
+
+// Merges the fast bins, shrinks the heap to its top chunk plus pad, then decommits free blocks
+size_t mm_trim_arena(arena_t* a, size_t pad) {
+	mm_consolidate(a);
+	size_t released = mm_trim_top(a, pad);
+
+	for (size_t i = 0; i < MM_BIN_COUNT; i++) {
+		for (header_t* h = a->free_lists[i]; h; h = MM_GET_NEXT(h))
+			released += mm_decommit_free(h);
+	}
+
+	return released;
+}
+
+// Maps len bytes, a multiple of the huge page size, at a huge page boundary
+// advised tells whether the kernel took the huge page advice
+static void* mm_mmap_huge(size_t len, _Bool* advised) {
+	size_t over = len + MM_HUGE_PAGE_SIZE - MM_PAGE_SIZE;
+	MM_COUNT(mmap_calls, 1);
+	uint8_t* map = mmap(NULL, over, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-	header_t* last_header;
-	header_t* next_header = mm_heap_start;
-	while ((void*)next_header < old_end) {
-		last_header = next_header;
-		next_header = MM_NEXT_HEADER(next_header);
+	if (map == (void*)-1) {
+#ifdef MM_DEBUG
+		perror("mmap");
+#endif
+		return NULL;
 	}
-	void* payload;
 
-	// If the last block is free it gets extended
-	// Otherwise a new one is created
-	if (MM_IS_FREE(last_header)) {
-		mm_remove_free(last_header);
-		size_t new_size = mm_heap_size + MM_GET_SIZE(last_header);
-		last_header->size = MM_SET_XFREE(new_size);
-		mm_add_to_free(last_header);
-		payload = MM_PAYLOAD(last_header);
-	} else {
-		header_t* new_header = (header_t*)old_end;
-		size_t new_size = mm_heap_size - MM_METADATA_SIZE;
-		new_header->size = MM_SET_XFREE(new_size);
-		new_header->prev = last_header;
-		mm_add_to_free(new_header);
-		payload = MM_PAYLOAD(new_header);
-	}
-
-	mm_heap_size *= 2;
-	mm_poison_free(payload);
-	mm_write_canary(MM_HEADER(payload));
-
-	for (int i = 0; i < MM_BIN_COUNT; i++) {
-		int count = 0;
-		header_t* cur = mm_free_lists[i];
-		while (cur) {
-			count++;
-			cur = MM_GET_NEXT(cur);
-		}
+	uint8_t* start = (uint8_t*)MM_HUGE_ALIGN((uintptr_t)map);
+	if (start > map) {
+		MM_COUNT(munmap_calls, 1);
+		munmap(map, start - map);
 	}
-	return 1;
+	if (start + len < map + over) {
+		MM_COUNT(munmap_calls, 1);
+		munmap(start + len, map + over - start - len);
+	}
+
+	*advised = mm_advise_huge(NULL, (uintptr_t)start, (uintptr_t)start + len);
+	return start;
 }
 
-// Allocates the requested size directly with mmap
+// Allocates the requested size directly with mmap, or reuses a cached chunk
 // should only be used on big chunks
-void* mm_mmap_alloc(size_t size) {
+// The header records the whole chunk, so a reused chunk may be bigger than asked
+// zeroed, if not NULL, tells whether the payload is fresh from the kernel
+void* mm_mmap_alloc(size_t size, _Bool* zeroed) {
+	MM_LATENCY_SCOPE(MM_LATENCY_MMAP_ALLOC);
+	mm_init_options();
 	size = MM_ALIGN_UP(size);
 	size_t tot_size = MM_PAGE_ALIGN(size + MM_METADATA_SIZE);
-	void* new = mmap(NULL, tot_size, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-	if (new == (void*)-1) {
+	if (MM_OPT(thp) && tot_size >= MM_HUGE_PAGE_SIZE &&
+	    MM_HUGE_ALIGN(tot_size) - tot_size <= tot_size / MM_THP_MMAP_WASTE) {
+		_Bool advised;
+		tot_size = MM_HUGE_ALIGN(tot_size);
+		header_t* header = mm_mmap_huge(tot_size, &advised);
+		if (!header)
+			return NULL;
+
+		if (zeroed)
+			*zeroed = 1;
+
+		header->size = MM_SET_MMAP(MM_CLR_FREE(tot_size - MM_METADATA_SIZE));
+		MM_SET_MMAP_LEAD(header, advised ? MM_MMAP_THP_BIT : 0);
+
+		MM_COUNT(mmap_bytes, tot_size);
+		MM_COUNT(mmap_chunks, 1);
+
+		return MM_PAYLOAD(header);
+	}
+
+	void* new = mm_mmap_cache_get(&tot_size);
+
+	if (zeroed)
+		*zeroed = !new;
+
+	if (!new) {
+		MM_COUNT(mmap_calls, 1);
+		new = mmap(NULL, tot_size, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (new == (void*)-1) {
 #ifdef MM_DEBUG
-		perror("mmap");
+			perror("mmap");
 #endif
-		return 0;
+			return 0;
+		}
 	}
 
 	header_t* header = (header_t*)new;
-	header->size = MM_SET_MMAP(MM_CLR_FREE(size));
+	header->size = MM_SET_MMAP(MM_CLR_FREE(tot_size - MM_METADATA_SIZE));
+	MM_SET_MMAP_LEAD(header, 0);
+
+	MM_COUNT(mmap_bytes, tot_size);
+	MM_COUNT(mmap_chunks, 1);
 
 	return (void*)((uint8_t*)new + MM_HEADER_SIZE);
 }
 
+// Maps enough for the payload to be aligned anywhere in the mapping,
+// then unmaps the whole pages before and after the block
+// Aligned chunks bypass the mmap cache on allocation
+void* mm_mmap_alloc_aligned(size_t size, size_t align) {
+	size = MM_ALIGN_UP(size);
+	size_t len = MM_PAGE_ALIGN(size + MM_METADATA_SIZE + align);
+	MM_COUNT(mmap_calls, 1);
+	uint8_t* map = mmap(NULL, len, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (map == (void*)-1) {
+#ifdef MM_DEBUG
+		perror("mmap");
+#endif
+		return NULL;
+	}
+
+	uintptr_t payload = ((uintptr_t)map + MM_HEADER_SIZE + align - 1) & ~(uintptr_t)(align - 1);
+	uint8_t* header = (uint8_t*)(payload - MM_HEADER_SIZE);
+	uint8_t* start = (uint8_t*)((uintptr_t)header & ~(uintptr_t)(MM_PAGE_SIZE - 1));
+	uint8_t* end = (uint8_t*)MM_PAGE_ALIGN(payload + size + MM_CANARY_SIZE);
+
+	if (start > map) {
+		MM_COUNT(munmap_calls, 1);
+		munmap(map, start - map);
+	}
+	if (end < map + len) {
+		MM_COUNT(munmap_calls, 1);
+		munmap(end, map + len - end);
+	}
+
+	header_t* h = (header_t*)header;
+	h->size = MM_SET_MMAP(MM_CLR_FREE(end - header - MM_METADATA_SIZE));
+	MM_SET_MMAP_LEAD(h, header - start);
+
+	MM_COUNT(mmap_bytes, end - start);
+	MM_COUNT(mmap_chunks, 1);
+
+	return (void*)payload;
+}
+
 void mm_mmap_free(header_t* header) {
-	size_t size = MM_GET_SIZE(header) + MM_METADATA_SIZE;
+	MM_LATENCY_SCOPE(MM_LATENCY_MMAP_FREE);
+	size_t lead = MM_MMAP_LEAD(header);
+	void* start = (uint8_t*)header - lead;
+	size_t size = lead + MM_GET_SIZE(header) + MM_METADATA_SIZE;
+
+	MM_COUNT(mmap_bytes, -size);
+	MM_COUNT(mmap_chunks, -1);
+
+	if (MM_MMAP_IS_THP(header))
+		MM_COUNT(thp_bytes, -size);
+	else if (mm_mmap_cache_put(start, size))
+		return;
 
-	if (munmap((void*)header, size) == -1) {
+	MM_COUNT(munmap_calls, 1);
+	if (munmap(start, size) == -1) {
 #ifdef MM_DEBUG
 		perror("mmap");
 #endif
 	}
 }
+
+// Resizes an mmap chunk, shrinking unmaps its tail and growing lets the kernel
+// move its pages instead of copying them
+void* mm_mmap_realloc(header_t* h, size_t size) {
+	size = MM_ALIGN_UP(size);
+	size_t lead = MM_MMAP_LEAD(h);
+	uint8_t* start = (uint8_t*)h - lead;
+	size_t old_len = lead + MM_GET_SIZE(h) + MM_METADATA_SIZE;
+	size_t new_len = MM_PAGE_ALIGN(lead + size + MM_METADATA_SIZE);
+	_Bool thp = MM_MMAP_IS_THP(h);
+
+	// Huge page chunks stay whole huge pages, a move may still lose their alignment
+	if (thp)
+		new_len = MM_HUGE_ALIGN(new_len);
+
+	if (new_len < old_len) {
+		MM_COUNT(munmap_calls, 1);
+		if (munmap(start + new_len, old_len - new_len) == -1) {
+#ifdef MM_DEBUG
+			perror("munmap");
+#endif
+			// The chunk is still valid at its old size
+			return MM_PAYLOAD(h);
+		}
+	} else if (new_len > old_len) {
+		MM_COUNT(mremap_calls, 1);
+		void* new = mremap(start, old_len, new_len, MREMAP_MAYMOVE);
+
+		if (new == MAP_FAILED) {
+#ifdef MM_DEBUG
+			perror("mremap");
+#endif
+			return NULL;
+		}
+
+		h = (header_t*)((uint8_t*)new + lead);
+	}
+
+	MM_COUNT(mmap_bytes, new_len - old_len);
+	if (thp)
+		MM_COUNT(thp_bytes, new_len - old_len);
+	h->size = MM_SET_MMAP(MM_CLR_FREE(new_len - lead - MM_METADATA_SIZE));
+	return MM_PAYLOAD(h);
+}
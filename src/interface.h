@@ -6,11 +6,15 @@
 #ifndef MM_PRIVATE_HEADER
 #define MM_PRIVATE_HEADER
 
+#include <pthread.h>
 #include <stdalign.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "mem.h"
+
 /*
  * INTERNAL ALLOCATOR LAYOUT
  *
@@ -18,12 +22,25 @@
  *   - payload size (aligned)
  *   - MM_MMAP_BIT (is allocated with mmap)
  *   - MM_FREE_BIT (is free)
+ *   - MM_FENCE_BIT (ends a main heap segment, see Segments)
+ *   - MM_PREV_FREE_BIT (the previous block is free)
+ *
+ * Boundary tags:
+ *   - A block only knows its previous block through the previous block's size,
+ *     stored in its own prev_foot, and only while the previous block is free
+ *   - While a block is allocated, the prev_foot of the next header is part of its payload,
+ *     so an allocated block costs one size word (not in debug mode, the canary sits in between)
+ *   - MM_LINK_NEXT_HEADER must follow any change to a block's size or free bit
+ *     that has a next block
  *
  * Free list:
- *   - Multiple segregated lists
- *   - MM_BIN_COUNT lists, up to 63
- *   - Singly-linked
- *   - First-fit
+ *   - Two-level segregated fit (TLSF) index
+ *   - The first level is a power-of-two class, the second level splits
+ *     each class linearly into MM_SL_COUNT lists
+ *   - Sizes below MM_SMALL_BLOCK share first level 0, one list per MM_ALIGNMENT
+ *   - fl_map marks first levels with any block, sl_map[fl] marks their lists
+ *   - A request is rounded up to the next list boundary, so any block of the
+ *     first non-empty list from there fits, only the last list is scanned
  *   - In debug mode the next and previous pointers are part of header_t
  *   - In release mode they're stored in the payload
  *   - That is to try to prevent a use-after-free from corrupting the free list
@@ -33,6 +50,7 @@
  *
  *   Normal:
  *     [ Header | Payload ]
+ *     A free block's size is repeated in the prev_foot of the next header
  *
  *   DEBUG:
  *     [ Header | Payload | Canary ]
@@ -41,58 +59,135 @@
  *   - Free blocks must be in the free list
  *   - The free list must not include duplicates
  *   - All blocks are MM_ALIGNMENT-aligned
- *   - header->prev must always be correct
+ *   - No two free blocks are neighbours
+ *   - MM_PREV_FREE_BIT and the prev_foot of a free block must always be correct
  */
 
 #ifdef MM_DEBUG
 typedef struct header {
+	size_t prev_foot;
 	size_t size;
-	struct header* prev;
 	struct header* prev_free;
 	struct header* next_free;
 } header_t;
 #define MM_PAYLOAD_PTRS 0
+#define MM_SPILL 0
 #else
 typedef struct header {
+	size_t prev_foot;
 	size_t size;
-	struct header* prev;
 } header_t;
 #define MM_PAYLOAD_PTRS 2
+// The bytes of an allocated block's payload held by the next header's prev_foot
+#define MM_SPILL sizeof(size_t)
 #endif
 
-#define MM_BIN_COUNT 32
-#define MM_BIN_BASE MM_ALIGNMENT
-extern header_t* mm_free_lists[MM_BIN_COUNT];
-
-#if MM_BIN_COUNT <= 8
-typedef uint8_t bins_map_t;
-#elif MM_BIN_COUNT <= 16
-typedef uint16_t bins_map_t;
-#elif MM_BIN_COUNT <= 32
-typedef uint32_t free_map_t;
-#elif MM_BIN_COUNT < 64
-typedef uint64_t bins_map_t;
-#else
-#error "Too many bins for bitmap"
-#endif
+#define MMAP_THRESHOLD (128 * 1024)
+#define MM_MMAP_THRESHOLD_MAX ((size_t)32 * 1024 * 1024)
+// Alignments from here on are served by mmap
+#define MM_ALIGNED_MMAP_THRESHOLD MMAP_THRESHOLD
+#define MM_INITIAL_HEAP_SIZE 4096
+#define MM_GROWTH_FACTOR 2
+// Heaps past MM_GROWTH_MAX_STEP / (factor - 1) grow linearly
+#define MM_GROWTH_MAX_STEP ((size_t)32 * 1024 * 1024)
+#define MM_HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+#define MM_HUGE_ALIGN(x) (((x) + MM_HUGE_PAGE_SIZE - 1) & ~(MM_HUGE_PAGE_SIZE - 1))
 
-extern free_map_t mm_free_map;
+/*
+ * Transparent huge pages (off by default, see MM_OPT_THP):
+ *   - The heap starts and grows at huge page boundaries, new space is madvise(MADV_HUGEPAGE)d
+ *   - Trimming only gives back whole huge pages, so none gets split
+ *   - mmap chunks whose rounding to huge pages costs at most 1/MM_THP_MMAP_WASTE
+ *     of their size are huge page aligned, advised and kept out of the mmap cache
+ *   - mm_counters.thp_bytes is the part of the heap and chunks advised this way
+ */
+#define MM_THP_MMAP_WASTE 8
 
 /*
- * Heap state:
- *   heap_start pointer to the start of sbrk heap
- *   heap_end pointer to the byte after the end of sbrk heap
- *   heap_initialized must be true before allocations
- *   heap_size reflects current heap_end - heap_start
+ * mmap cache:
+ *   - Freed mmap chunks are kept for reuse instead of being unmapped
+ *   - Bucketed by log2 of their page count
+ *   - A request takes a chunk of at least its size and at most twice that
+ *   - At most MM_MMAP_CACHE_MAX_CHUNKS chunks and MM_MMAP_CACHE_MAX_BYTES bytes,
+ *     the oldest chunks are unmapped first
+ *   - Chunks older than MM_MMAP_CACHE_MAX_AGE_MS are unmapped on the next cache operation
  */
 
-extern void* mm_heap_start;
-extern void* mm_heap_end;
-extern size_t mm_heap_size;
-extern _Bool mm_heap_initialized;
+#define MM_MMAP_CACHE_BUCKETS 20
+#define MM_MMAP_CACHE_MAX_CHUNKS 16
+#define MM_MMAP_CACHE_MAX_BYTES ((size_t)64 * 1024 * 1024)
+#define MM_MMAP_CACHE_MAX_AGE_MS 1000
 
-#define MMAP_THRESHOLD (128 * 1024)
-#define MM_INITIAL_HEAP_SIZE 4096
+extern pthread_mutex_t mm_mmap_cache_lock;
+
+// free() trims the heap once the top chunk reaches the trim threshold, 0 disables it
+#define MM_TRIM_THRESHOLD (128 * 1024)
+#define MM_TRIM_PAD 0
+
+/*
+ * Fast bins:
+ *   - Heap blocks of at most MM_OPT(fast_max_size) bytes freed to an arena are
+ *     held unmerged, one LIFO list per size, and a malloc of that size takes them back
+ *   - Like cached blocks they stay marked as allocated, so nothing coalesces with them
+ *   - mm_consolidate() frees them all for good when a request bigger than
+ *     the fast bins misses, before the heap grows and before trimming
+ *   - The next pointer of a held block is stored in its payload's first word
+ */
+#define MM_FAST_MAX_SIZE 512
+#define MM_FAST_BINS (1024 / MM_ALIGNMENT)
+
+/*
+ * Heap profiler:
+ *   - Each thread counts the bytes it allocates down from an exponentially
+ *     distributed interval of mean MM_OPT(profile_rate), the allocation that
+ *     crosses zero is sampled, so samples form a Poisson process over bytes
+ *   - A sample records the stack and the requested size in a bucket per stack,
+ *     live samples are kept by pointer so a free can retire them
+ *   - A free only takes the profiler's lock if its pointer's filter counter is set
+ *   - Tables are mapped directly, nothing in the profiler goes through malloc,
+ *     allocations made while sampling (backtrace loading libgcc) are never sampled
+ *   - Full tables drop new samples and count them
+ */
+#define MM_PROFILE_RATE (512 * 1024)
+#define MM_PROFILE_DEPTH 32
+#define MM_PROFILE_BUCKETS 4096
+#define MM_PROFILE_SAMPLES ((size_t)1 << 16)
+#define MM_PROFILE_FILTER ((size_t)1 << 18)
+
+/*
+ * Tunables:
+ *   - The constants above are only the defaults, the live values are in mm_opts
+ *   - The environment (see mm_env_options) is read once, at load time or
+ *     when the first heap is initialized or the first chunk is mapped
+ *   - mm_mallopt() changes them at any time, they're read without locks
+ *   - Dynamic mmap threshold: freeing an mmap chunk bigger than the threshold
+ *     raises it to the chunk's size, up to MM_MMAP_THRESHOLD_MAX,
+ *     and the trim threshold to twice that
+ *   - Setting the mmap or trim threshold or the trim pad turns it off
+ */
+
+typedef struct mm_options {
+	size_t mmap_threshold;
+	size_t initial_heap_size;
+	size_t growth_factor;
+	size_t growth_max_step;
+	size_t trim_threshold;
+	size_t trim_pad;
+	size_t mmap_cache_max_chunks;
+	size_t mmap_cache_max_bytes;
+	size_t mmap_cache_max_age_ms;
+	size_t dynamic_mmap;
+	size_t thp;
+	size_t heap_reserve;
+	size_t fast_max_size;
+	size_t profile;
+	size_t profile_rate;
+	size_t waste;
+} mm_options_t;
+
+extern mm_options_t mm_opts;
+
+#define MM_OPT(name) __atomic_load_n(&mm_opts.name, __ATOMIC_RELAXED)
 
 #define MM_ALIGNMENT alignof(max_align_t)
 #define MM_ALIGN_UP(x) (((x) + MM_ALIGNMENT - 1) & ~(MM_ALIGNMENT - 1))
@@ -100,6 +195,213 @@ extern _Bool mm_heap_initialized;
 #define MM_PAGE_SIZE sysconf(_SC_PAGESIZE)
 #define MM_PAGE_ALIGN(x) (((x) + MM_PAGE_SIZE - 1) & ~(MM_PAGE_SIZE - 1))
 
+#define MM_SL_BITS 4
+#define MM_SL_COUNT (1 << MM_SL_BITS)
+#define MM_FL_COUNT 24
+#define MM_BIN_COUNT (MM_FL_COUNT * MM_SL_COUNT)
+#define MM_SMALL_BLOCK (MM_ALIGNMENT << MM_SL_BITS)
+
+typedef uint32_t fl_map_t;
+typedef uint16_t sl_map_t;
+
+_Static_assert(MM_FL_COUNT <= sizeof(fl_map_t) * 8, "Too many first levels for fl_map_t");
+_Static_assert(MM_SL_COUNT <= sizeof(sl_map_t) * 8, "Too many second levels for sl_map_t");
+_Static_assert(MM_FL_COUNT == MM_STATS_FREE_CLASSES, "Stats report one free class per first level");
+
+/*
+ * Arenas:
+ *   - Each arena owns a heap, its free lists and the bitmap, all guarded by its lock
+ *   - Every heap lives in address space reserved PROT_NONE up front,
+ *     growing it commits the next pages with mprotect
+ *   - The main arena's heap is a list of segments of MM_OPT_HEAP_RESERVE bytes,
+ *     or less if the address space is limited, see below
+ *   - Every other arena lives in its own MM_ARENA_REGION_SIZE region,
+ *     aligned to its size, with the arena_t at the start of the region
+ *   - Threads are assigned to arenas round-robin on their first allocation
+ *   - A block belongs to the main arena if it lies in one of its segments,
+ *     otherwise its arena is found by masking the block address
+ *   - An arena whose region is exhausted falls back to the main arena
+ *
+ * Heap state:
+ *   heap_start pointer to the first block of the heap
+ *   heap_end pointer to the byte after the top chunk
+ *   region_end pointer to the end of the current reservation, short of a fence for the main arena
+ *   commit_end pointer to the end of the committed pages of the current reservation
+ *   top the last block of the heap, see below
+ *   initialized must be true before allocations
+ *   heap_size the bytes of every block, fences excluded
+ *
+ * Segments:
+ *   - Once the main arena's reservation can't hold a growth, a new one is reserved
+ *   - The old top chunk goes to the free lists and a fence ends the old segment,
+ *     an allocated header of size 0 whose payload points to the next segment
+ *   - Nothing merges with a fence and the first block of a segment never has
+ *     MM_PREV_FREE_BIT, so blocks never span segments
+ *   - Heap walks step over fences with MM_WALK_NEXT, a block has no next
+ *     once MM_NEXT_HEADER reaches heap_end or a fence
+ *
+ * Top chunk:
+ *   - The trailing free space of the heap is kept out of the free lists
+ *   - It's marked free and always ends at heap_end, its payload may be empty
+ *   - Free list misses are carved from its front
+ *   - Heap growth appends to it, blocks freed next to it merge into it
+ *   - Trimming gives back the whole pages at its end, its header stays
+ *
+ * Known-zero memory:
+ *   - zero_mark is the highest address the top chunk's header has reached
+ *   - Payload bytes past it were never handed out, so they're still zero
+ *     as the kernel provided them
+ *   - Trimming never lowers it, released pages come back zeroed
+ *   - calloc() skips the memset for blocks carved from past it,
+ *     for fresh mmap chunks and for never used slab objects
+ *   - Poisoning in debug mode defeats all of this
+ *
+ * Statistics:
+ *   - free_bytes counts the free list blocks of each first level,
+ *     headers included, updated as blocks enter and leave the lists
+ *   - slab_runs and slab_used count the arena's runs and its live slab bytes
+ *   - Everything else is in mm_counters, updated atomically
+ *   - Thread cached blocks are still allocated, so they count as in use
+ *
+ * Trimming:
+ *   - Releases the end of the top chunk by mapping PROT_NONE over its whole pages,
+ *     which returns both the memory and the commit charge
+ *   - Free blocks keep their header and free list links,
+ *     only the whole pages past them are decommitted
+ *
+ * Aligned blocks:
+ *   - Alignments up to MM_ALIGNMENT are plain allocations
+ *   - Heap blocks are carved with room for the alignment and a lead big
+ *     enough to be a block, the lead goes back to the free lists
+ *   - Large sizes or alignments get a mapping of their own, over-sized
+ *     then trimmed to the whole pages around the aligned block
+ */
+
+/*
+ * Slabs:
+ *   - Requests up to MM_SLAB_MAX_SIZE are served from slab runs
+ *   - A run is MM_SLAB_RUN_SIZE bytes dedicated to one size class
+ *   - Size classes are multiples of MM_ALIGNMENT
+ *   - Objects carry no header, the run's free_map tracks them (set bit = free)
+ *   - Runs are carved from one reserved region, a pointer is a slab object
+ *     iff it lies in the region, and its run is found by masking the pointer
+ *   - Each arena keeps a list of partially used runs per class,
+ *     full runs are unlinked until one of their objects is freed
+ *   - Empty runs go back to a shared pool unless they're the last partial run
+ *   - Objects from untouched on were never handed out since the run was
+ *     taken fresh from the region or trimmed
+ */
+
+#define MM_SLAB_MAX_SIZE 256
+#define MM_SLAB_CLASSES (MM_SLAB_MAX_SIZE / MM_ALIGNMENT)
+#define MM_SLAB_RUN_SIZE 4096
+#define MM_SLAB_REGION_SIZE ((size_t)1024 * 1024 * 1024)
+#define MM_SLAB_MAP_WORDS ((MM_SLAB_RUN_SIZE / MM_ALIGNMENT + 63) / 64)
+
+struct arena;
+
+typedef struct slab {
+	struct slab* next;
+	struct slab* prev;
+	struct arena* arena;
+	uint16_t size;
+	uint16_t count;
+	uint16_t used;
+	uint16_t untouched;
+	uint64_t free_map[MM_SLAB_MAP_WORDS];
+} slab_t;
+
+#define MM_SLAB_OBJS_OFFSET MM_ALIGN_UP(sizeof(slab_t))
+
+// Until the region is mapped the base points at the top of the address space,
+// so no user pointer passes MM_IS_SLAB
+extern uintptr_t mm_slab_base;
+extern pthread_mutex_t mm_slab_lock;
+
+static inline _Bool MM_IS_SLAB(void* p) {
+	return (uintptr_t)p - __atomic_load_n(&mm_slab_base, __ATOMIC_RELAXED) < MM_SLAB_REGION_SIZE;
+}
+static inline slab_t* MM_SLAB(void* p) { return (slab_t*)((uintptr_t)p & ~(uintptr_t)(MM_SLAB_RUN_SIZE - 1)); }
+
+typedef struct arena {
+	pthread_mutex_t lock;
+	slab_t* slabs[MM_SLAB_CLASSES];
+	header_t* free_lists[MM_BIN_COUNT];
+	fl_map_t fl_map;
+	sl_map_t sl_map[MM_FL_COUNT];
+	size_t free_bytes[MM_FL_COUNT];
+	size_t free_blocks;
+	header_t* fast_bins[MM_FAST_BINS];
+	size_t fast_blocks;
+	size_t fast_bytes;
+	void* deferred;
+	size_t slab_runs;
+	size_t slab_used;
+	void* heap_start;
+	void* heap_end;
+	void* region_end;
+	void* commit_end;
+	header_t* top;
+	uint8_t* zero_mark;
+	size_t heap_size;
+	size_t thp_bytes;
+	_Bool initialized;
+} arena_t;
+
+#define MM_ARENA_COUNT 8
+#define MM_ARENA_REGION_SIZE ((size_t)64 * 1024 * 1024)
+// The default size of a main heap segment, see MM_OPT_HEAP_RESERVE
+#define MM_HEAP_RESERVE ((size_t)64 * 1024 * 1024 * 1024)
+#define MM_MAX_SEGMENTS 64
+
+extern arena_t mm_main_arena;
+extern arena_t* mm_arenas[MM_ARENA_COUNT];
+
+// Arenas are published under mm_arenas_lock with a release store,
+// readers that don't take the lock load them with this
+static inline arena_t* mm_arena_at(size_t i) { return __atomic_load_n(&mm_arenas[i], __ATOMIC_ACQUIRE); }
+
+typedef struct mm_counters {
+	size_t mmap_bytes;
+	size_t mmap_chunks;
+	size_t grows;
+	size_t trims;
+	size_t mprotect_calls;
+	size_t mmap_calls;
+	size_t munmap_calls;
+	size_t mremap_calls;
+	size_t madvise_calls;
+	size_t segments;
+	size_t deferred_frees;
+	size_t requested_bytes;
+	size_t usable_bytes;
+	size_t thp_bytes;
+} mm_counters_t;
+
+extern mm_counters_t mm_counters;
+
+#define MM_COUNT(name, n) __atomic_fetch_add(&mm_counters.name, (n), __ATOMIC_RELAXED)
+
+// Requested and usable bytes are summed per thread and published every MM_WASTE_BATCH allocations
+#define MM_WASTE_BATCH 64
+
+#define MM_LOCK(a) pthread_mutex_lock(&(a)->lock)
+#define MM_UNLOCK(a) pthread_mutex_unlock(&(a)->lock)
+
+#define MM_TLS _Thread_local __attribute__((tls_model("initial-exec")))
+
+/*
+ * Thread safety:
+ *   - Every thread has a cache of recently freed payloads per size class
+ *   - Cached blocks stay marked as allocated, so nothing coalesces with them
+ *   - Only cache misses and overflows take an arena lock
+ *   - The next pointer of a cached payload is stored in its first word
+ */
+
+#define MM_TCACHE_MAX_SIZE 1024
+#define MM_TCACHE_BINS (MM_TCACHE_MAX_SIZE / MM_ALIGNMENT)
+#define MM_TCACHE_COUNT 16
+
 #ifdef MM_DEBUG
 #define MM_CANARY_BYTE 0xCC
 #define MM_POISON_FREE_BYTE 0xDD
@@ -121,16 +423,21 @@ extern _Bool mm_heap_initialized;
 #define MM_MIN_SPLIT (2 * MM_ALIGNMENT)
 #define MM_MIN_BLOCK_SPLIT (MM_MIN_SPLIT + MM_METADATA_SIZE)
 
+// Payload size of the heap block serving a request of s bytes
+#define MM_BLOCK_SIZE(s) MM_ALIGN_UP(MM_MAX((s), MM_MIN_PAYLOAD + MM_SPILL) - MM_SPILL)
+
 #define MM_FREE_BIT 0x1
 #define MM_MMAP_BIT 0x2
+#define MM_FENCE_BIT 0x4
+#define MM_PREV_FREE_BIT 0x8
+
+_Static_assert(MM_PREV_FREE_BIT < MM_ALIGNMENT, "MM_ALIGNMENT leaves no room for the flags");
 
 #define MM_FLAG_MASK ((size_t)(MM_ALIGNMENT - 1))
 #define MM_SIZE_MASK (~MM_FLAG_MASK)
 #define MM_FREE_MASK (~MM_FREE_BIT)
 #define MM_MMAP_MASK (~MM_MMAP_BIT)
 
-#define MM_BIN_BIT(i) ((free_map_t)1 << (i))
-
 /*
  * MM_GET_SIZE(b): extract payload size from header
  * MM_CLR_FLAGS(s): extract payload size from raw size_t
@@ -140,6 +447,8 @@ extern _Bool mm_heap_initialized;
 #define MM_CLR_FLAGS(s) ((s) & MM_SIZE_MASK)
 #define MM_IS_FREE(b) (((b)->size & MM_FREE_BIT) != 0)
 #define MM_IS_MMAP(b) (((b)->size & MM_MMAP_BIT) != 0)
+#define MM_IS_FENCE(b) (((b)->size & MM_FENCE_BIT) != 0)
+#define MM_IS_PREV_FREE(b) (((b)->size & MM_PREV_FREE_BIT) != 0)
 
 /*
  * SET_ FREE/MMAP set bit
@@ -153,8 +462,17 @@ extern _Bool mm_heap_initialized;
 #define MM_CLR_MMAP(s) ((s) & MM_MMAP_MASK)
 
 #define MM_SET_XFREE(s) (MM_SET_FREE(MM_CLR_FLAGS((s))))
+
+// Raw size s for block b, which keeps knowing whether its previous block is free
+#define MM_KEEP_PREV(b, s) ((s) | ((b)->size & MM_PREV_FREE_BIT))
 #define MM_SET_XMMAP(s) (MM_SET_MMAP(MM_CLR_FLAGS((s))))
 
+#ifdef MM_ENABLE_POISONING
+#define MM_KNOWN_ZERO(cond) ((void)(cond), 0)
+#else
+#define MM_KNOWN_ZERO(cond) (cond)
+#endif
+
 /*
  * Pointer macros assume:
  *   - (h): a pointer to a header
@@ -188,15 +506,54 @@ static inline header_t* MM_GET_PREV(header_t* h) { return *MM_GET_PREV_PTR(h); }
 // #define MM_CANARY(h) ((size_t*)((uint8_t*)(h) + MM_HEADER_SIZE + MM_GET_SIZE(h)))
 // #define MM_PAYLOAD(h) ((void*)((uint8_t*)(h) + MM_HEADER_SIZE))
 // #define MM_NEXT_HEADER(h) ((header_t*)((uint8_t*)(h) + MM_HEADER_SIZE + MM_GET_SIZE(h) + MM_CANARY_SIZE))
-// #define MM_LINK_NEXT_HEADER(h) (MM_NEXT_HEADER(h)->prev = (h));
 static inline header_t* MM_HEADER(void* payload) { return (header_t*)((uint8_t*)payload - MM_HEADER_SIZE); }
 static inline size_t* MM_CANARY(header_t* h) { return (size_t*)((uint8_t*)h + MM_HEADER_SIZE + MM_GET_SIZE(h)); }
 static inline void* MM_PAYLOAD(header_t* h) { return (void*)((uint8_t*)h + MM_HEADER_SIZE); }
 static inline header_t* MM_NEXT_HEADER(header_t* h) {
 	return (header_t*)((uint8_t*)h + MM_GET_SIZE(h) + MM_METADATA_SIZE);
 }
-static inline void MM_LINK_NEXT_HEADER(header_t* h) { MM_NEXT_HEADER(h)->prev = h; }
+
+// Tells the next block whether h is free, a free block also leaves its size there
+// An allocated block's prev_foot in the next header is left alone, it's payload
+static inline void MM_LINK_NEXT_HEADER(header_t* h) {
+	header_t* next = MM_NEXT_HEADER(h);
+	if (MM_IS_FREE(h)) {
+		next->prev_foot = MM_GET_SIZE(h);
+		next->size |= MM_PREV_FREE_BIT;
+	} else {
+		next->size &= ~(size_t)MM_PREV_FREE_BIT;
+	}
+}
+
+// Only valid while the previous block is free
+static inline header_t* MM_PREV_HEADER(header_t* h) {
+	return (header_t*)((uint8_t*)h - h->prev_foot - MM_METADATA_SIZE);
+}
+
+// A fence's payload points to the first block of the next segment
+#define MM_FENCE_ROOM (MM_HEADER_SIZE + MM_ALIGNMENT)
+static inline header_t** MM_FENCE_LINK(header_t* h) { return (header_t**)MM_PAYLOAD(h); }
+
+// The next block of a heap walk, which ends at heap_end
+static inline header_t* MM_WALK_NEXT(arena_t* a, header_t* h) {
+	header_t* next = MM_NEXT_HEADER(h);
+	if ((void*)next != a->heap_end && MM_IS_FENCE(next))
+		return *MM_FENCE_LINK(next);
+	return next;
+}
+
+// mmap chunks have no neighbours, their prev_foot holds the offset of the header
+// from the start of the mapping, which aligned chunks don't begin at
+// The lead isn't a whole number of pages: an aligned chunk's header sits just below its payload,
+// so a page-aligned payload leaves a lead of a page minus MM_HEADER_SIZE
+// It's always a multiple of MM_ALIGNMENT though, so its lowest bit marks chunks advised for huge pages
+// Nothing follows a chunk, so its payload never spills
+#define MM_MMAP_THP_BIT 0x1
+static inline size_t MM_MMAP_LEAD(header_t* h) { return h->prev_foot & ~(size_t)MM_MMAP_THP_BIT; }
+static inline _Bool MM_MMAP_IS_THP(header_t* h) { return (h->prev_foot & MM_MMAP_THP_BIT) != 0; }
+static inline void MM_SET_MMAP_LEAD(header_t* h, size_t lead) { h->prev_foot = lead; }
 #define MM_MAX(a, b) (a > b ? a : b)
+#define MM_MIN(a, b) (a < b ? a : b)
 
 #define MM_ABORT() __builtin_trap()
 
@@ -204,58 +561,223 @@ static inline void MM_LINK_NEXT_HEADER(header_t* h) { MM_NEXT_HEADER(h)->prev =
  * Function declarations
  *
  * Notes:
- *   - grow_heap doubles sbrk heap size
+ *   - functions taking an arena expect its lock to be held
+ *   - grow_heap grows the heap by at least request bytes, appending them to the top chunk
  *   - coalesce_* remove merged neighbors from free_list
- *   - caller must reinsert the resulting block
+ *   - caller must reinsert the resulting block, unless it became the top chunk
  */
 
 // debug.c
-void mm_debug_test(void);
+void mm_debug_test(arena_t* a);
 void mm_write_canary(header_t* h);
 void mm_check_canary(header_t* h);
 void mm_poison_free(void* p);
 void mm_poison_alloc(void* p);
 void mm_poison_free_area(void* p, size_t s);
 void mm_poison_alloc_area(void* p, size_t s);
-void mm_heap_check(void);
-void mm_free_check(void);
+void mm_heap_check(arena_t* a);
+void mm_free_check(arena_t* a);
+void mm_fast_check(arena_t* a);
 
 #ifdef MM_DEBUG
-#define MM_RUN_CHECKS() mm_debug_test()
+#define MM_RUN_CHECKS(a) mm_debug_test(a)
 #else
-#define MM_RUN_CHECKS() ((void)0)
+#define MM_RUN_CHECKS(a) ((void)0)
 #endif
 
 // heap.c
-_Bool mm_init_heap(void);
-_Bool mm_grow_heap(void);
-void* mm_mmap_alloc(size_t size);
+arena_t* mm_arena_get(void);
+arena_t* mm_arena_of(header_t* header);
+_Bool mm_init_heap(arena_t* a);
+_Bool mm_in_heap(arena_t* a, void* p);
+_Bool mm_grow_heap(arena_t* a, size_t request);
+size_t mm_trim_top(arena_t* a, size_t pad);
+size_t mm_trim_arena(arena_t* a, size_t pad);
+void* mm_mmap_alloc(size_t size, _Bool* zeroed);
+void* mm_mmap_alloc_aligned(size_t size, size_t align);
 void mm_mmap_free(header_t* header);
+void* mm_mmap_realloc(header_t* header, size_t size);
 size_t mm_idx_from_size(size_t s);
 size_t mm_size_from_idx(size_t i);
 
 // free_list.c
-void mm_add_to_free(header_t* h);
-_Bool mm_remove_free(header_t* h);
-header_t* mm_find_fit(size_t size);
+void mm_add_to_free(arena_t* a, header_t* h);
+_Bool mm_remove_free(arena_t* a, header_t* h);
+header_t* mm_find_fit(arena_t* a, size_t size);
 
 // block.c
-void mm_coalesce_prev(header_t** header_ptr);
-void mm_coalesce_next(header_t* header);
-void mm_shrink_block(header_t* header, size_t size, _Bool is_free);
-_Bool mm_grow_block(header_t* header, size_t size, _Bool is_free);
-void* mm_malloc_block(size_t size);
+void mm_coalesce_prev(arena_t* a, header_t** header_ptr);
+void mm_coalesce_next(arena_t* a, header_t* header);
+void mm_shrink_block(arena_t* a, header_t* header, size_t size, _Bool is_free);
+_Bool mm_grow_block(arena_t* a, header_t* header, size_t size, _Bool is_free);
+header_t* mm_carve_top(arena_t* a, size_t size);
+void* mm_malloc_block(arena_t* a, size_t size, _Bool* zeroed);
+void* mm_malloc_aligned_block(arena_t* a, size_t size, size_t align);
+void mm_free_block(arena_t* a, header_t* header);
+_Bool mm_fast_put(arena_t* a, header_t* header);
+_Bool mm_consolidate(arena_t* a);
+size_t mm_malloc_block_batch(arena_t* a, size_t size, size_t n, void** out);
+void mm_free_block_batch(arena_t* a, void** ptrs, size_t n);
+
+// options.c
+void mm_init_options(void);
+int mm_mallopt(int param, size_t value);
+int mallopt(int param, int value);
+void mm_adjust_mmap_threshold(size_t size);
+
+// mmap_cache.c
+void* mm_mmap_cache_get(size_t* len);
+_Bool mm_mmap_cache_put(void* p, size_t len);
+
+// slab.c
+void* mm_slab_alloc(arena_t* a, size_t size, _Bool* zeroed);
+void mm_slab_free(slab_t* s, void* p);
+size_t mm_slab_trim(void);
+
+// tcache.c
+void* mm_tcache_get(size_t size);
+_Bool mm_tcache_put(void* p, size_t size);
+void mm_tcache_flush(void);
 
 // mem.c
+void mm_free_shared(void* p);
+
+/*
+ * Deferred frees:
+ *   - mm_free_deferred() pushes a slab object or heap block onto its arena's
+ *     deferred stack with a compare and swap, any number of threads may push at once
+ *   - The next pointer is stored in the payload's first word
+ *   - Whoever holds the arena's lock next takes the whole stack with one exchange
+ *     and frees it, on the arena's next malloc or free or from mm_trim()
+ *   - Taking everything at once means nothing is ever popped, so there's no ABA
+ */
+void mm_drain_deferred(arena_t* a);
+void mm_free_deferred(void* ptr);
+
 void* malloc(size_t size);
 void* realloc(void* ptr, size_t size);
 void* calloc(size_t size, size_t n);
 void free(void* ptr);
+size_t malloc_usable_size(void* ptr);
+void free_sized(void* ptr, size_t size);
+void free_aligned_sized(void* ptr, size_t alignment, size_t size);
+size_t mm_malloc_batch(size_t size, size_t n, void** out);
+void mm_free_batch(void** ptrs, size_t n);
+int posix_memalign(void** memptr, size_t alignment, size_t size);
+void* aligned_alloc(size_t alignment, size_t size);
+void* memalign(size_t alignment, size_t size);
+void* valloc(size_t size);
+void* pvalloc(size_t size);
+int mm_trim(size_t pad);
+int malloc_trim(size_t pad);
+void mm_get_mmap_cache_stats(struct mm_mmap_cache_stats* s);
+
+// trace.c
+// A record can be reserved ahead of the call and written once its result is known,
+// the record's place in the trace is the reservation's
+struct mm_trace_record;
+
+#ifdef MM_TRACE
+void mm_trace(uint8_t op, void* ptr, void* old, size_t size);
+struct mm_trace_record* mm_trace_reserve(void);
+void mm_trace_commit(struct mm_trace_record* r, uint8_t op, void* ptr, void* old, size_t size);
+#else
+static inline void mm_trace(uint8_t op, void* ptr, void* old, size_t size) {
+	(void)op;
+	(void)ptr;
+	(void)old;
+	(void)size;
+}
+static inline struct mm_trace_record* mm_trace_reserve(void) { return NULL; }
+static inline void mm_trace_commit(struct mm_trace_record* r, uint8_t op, void* ptr, void* old, size_t size) {
+	(void)r;
+	(void)op;
+	(void)ptr;
+	(void)old;
+	(void)size;
+}
+#endif
+
+// latency.c
+// The scan histogram follows the operations
+#define MM_LATENCY_SCAN MM_LATENCY_OPS
+
+#ifdef MM_LATENCY
+typedef struct mm_latency_timer {
+	uint64_t start;
+	unsigned op;
+} mm_latency_timer_t;
+
+void mm_latency_record(unsigned op, uint64_t value);
+
+static inline uint64_t mm_latency_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t t;
+	__asm__ volatile("mrs %0, cntvct_el0" : "=r"(t));
+	return t;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void mm_latency_stop(mm_latency_timer_t* t) { mm_latency_record(t->op, mm_latency_now() - t->start); }
+
+// Times the rest of the enclosing scope, every return included
+#define MM_LATENCY_SCOPE(op)                                                                                           \
+	mm_latency_timer_t mm_latency_timer __attribute__((cleanup(mm_latency_stop))) = {mm_latency_now(), (op)}
+
+static inline void mm_latency_scan(size_t n) { mm_latency_record(MM_LATENCY_SCAN, n); }
+#else
+#define MM_LATENCY_SCOPE(op) (void)(op)
+
+static inline void mm_latency_scan(size_t n) { (void)n; }
+#endif
+
+// analyze.c
+size_t mm_heap_analyze(char* buf, size_t len);
+
+// profile.c
+typedef struct mm_profile_sample {
+	void* ptr;
+	size_t size;
+	struct mm_profile_bucket* bucket;
+} mm_profile_sample_t;
+
+extern MM_TLS ptrdiff_t mm_profile_left;
+extern size_t mm_profile_live;
+void mm_profile_sample(void* p, size_t size);
+void mm_profile_retire(void* p);
+_Bool mm_profile_take(void* p, mm_profile_sample_t* out);
+void mm_profile_restore(const mm_profile_sample_t* s);
+int mm_profile_dump(const char* path);
+
+static inline void mm_profile_alloc(void* p, size_t size) {
+	mm_profile_left -= (ptrdiff_t)MM_MIN(size, (size_t)PTRDIFF_MAX);
+	if (mm_profile_left < 0)
+		mm_profile_sample(p, size);
+}
+
+static inline void mm_profile_free(void* p) {
+	if (__atomic_load_n(&mm_profile_live, __ATOMIC_RELAXED))
+		mm_profile_retire(p);
+}
+
+// Retires p's sample and copies it to out, returns 0 if p wasn't sampled
+static inline _Bool mm_profile_detach(void* p, mm_profile_sample_t* out) {
+	return __atomic_load_n(&mm_profile_live, __ATOMIC_RELAXED) && mm_profile_take(p, out);
+}
 
 // stats.c
 void mm_add_alloced(size_t n, _Bool mmap);
 void mm_print_alloced(void);
 void mm_print_free(void);
 void mm_print_stats(void);
+void mm_get_stats(struct mm_stats* s);
+struct mm_mallinfo2 mm_mallinfo2(void);
+size_t mm_thp_backed_bytes(void);
 
 #endif
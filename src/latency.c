@@ -0,0 +1,110 @@
+#include "interface.h"
+
+#include <string.h>
+
+/*
+ * Latency histograms
+ *
+ * One histogram per operation, shared by every thread and updated with
+ * relaxed atomics like mm_counters, so a reader may see a call in count
+ * before it shows up in its bucket
+ * Timing a call costs two counter reads and four atomic adds,
+ * the histograms only exist in builds with -DMM_LATENCY
+ */
+
+#define MM_LATENCY_SUB_BITS 3
+#define MM_LATENCY_SUB (1u << MM_LATENCY_SUB_BITS)
+
+size_t mm_latency_bucket_min(size_t i) {
+	if (i < MM_LATENCY_SUB)
+		return i;
+
+	size_t shift = (i >> MM_LATENCY_SUB_BITS) - 1;
+	return (MM_LATENCY_SUB | (i & (MM_LATENCY_SUB - 1))) << shift;
+}
+
+size_t mm_latency_quantile(const struct mm_latency_hist* h, double q) {
+	if (!h->count)
+		return 0;
+
+	// The rank of the quantile, counting from 1
+	size_t rank = (size_t)(q * (double)h->count);
+	rank = MM_MAX(MM_MIN(rank, h->count), (size_t)1);
+
+	size_t seen = 0;
+	for (size_t i = 0; i < MM_LATENCY_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank)
+			return mm_latency_bucket_min(i);
+	}
+
+	// The buckets trail count while calls are being recorded
+	return mm_latency_bucket_min(MM_LATENCY_BUCKETS - 1);
+}
+
+#ifdef MM_LATENCY
+
+static struct mm_latency_hist mm_latency[MM_LATENCY_OPS + 1];
+
+static inline size_t mm_latency_bucket(uint64_t v) {
+	if (v < MM_LATENCY_SUB)
+		return (size_t)v;
+
+	// The top bit picks the power of two, the next MM_LATENCY_SUB_BITS the bucket inside it
+	unsigned shift = 63 - (unsigned)__builtin_clzll(v) - MM_LATENCY_SUB_BITS;
+	size_t i = ((size_t)(shift + 1) << MM_LATENCY_SUB_BITS) | (size_t)((v >> shift) & (MM_LATENCY_SUB - 1));
+
+	return MM_MIN(i, (size_t)MM_LATENCY_BUCKETS - 1);
+}
+
+void mm_latency_record(unsigned op, uint64_t value) {
+	struct mm_latency_hist* h = &mm_latency[op];
+
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, (size_t)value, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->buckets[mm_latency_bucket(value)], 1, __ATOMIC_RELAXED);
+
+	size_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (value > max &&
+	       !__atomic_compare_exchange_n(&h->max, &max, (size_t)value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void mm_latency_copy(struct mm_latency_hist* dst, struct mm_latency_hist* src) {
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	for (size_t i = 0; i < MM_LATENCY_BUCKETS; i++)
+		dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+}
+
+int mm_get_latency_stats(struct mm_latency_stats* s) {
+	for (size_t i = 0; i < MM_LATENCY_OPS; i++)
+		mm_latency_copy(&s->ops[i], &mm_latency[i]);
+	mm_latency_copy(&s->find_fit_scan, &mm_latency[MM_LATENCY_SCAN]);
+	return 1;
+}
+
+// Calls in flight may still land in the old counts
+void mm_reset_latency_stats(void) {
+	for (size_t op = 0; op <= MM_LATENCY_OPS; op++) {
+		struct mm_latency_hist* h = &mm_latency[op];
+
+		__atomic_store_n(&h->count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->sum, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&h->max, 0, __ATOMIC_RELAXED);
+		for (size_t i = 0; i < MM_LATENCY_BUCKETS; i++)
+			__atomic_store_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+	}
+}
+
+#else
+
+int mm_get_latency_stats(struct mm_latency_stats* s) {
+	memset(s, 0, sizeof(*s));
+	return 0;
+}
+
+void mm_reset_latency_stats(void) {}
+
+#endif
@@ -1,14 +1,157 @@
 #include "interface.h"
+#include "trace.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 
-void* malloc(size_t size) {
+// Debug builds abort on a heap block outside its arena's heap
+static inline void mm_check_range(arena_t* a, header_t* h) {
+#ifdef MM_DEBUG
+	if (!mm_in_heap(a, h)) {
+		fprintf(stderr, "Ptr is not in the accepted range\n");
+		fflush(stderr);
+		MM_ABORT();
+	}
+#else
+	(void)a;
+	(void)h;
+#endif
+}
+
+// Debug builds abort on a double free, release builds skip the free
+static inline _Bool mm_check_double_free(_Bool freed) {
+#ifdef MM_DEBUG
+	if (freed) {
+		fprintf(stderr, "Double free detected\n");
+		fflush(stderr);
+		MM_ABORT();
+	}
+#endif
+	return freed;
+}
+
+// Frees every block pushed by mm_free_deferred, expects the arena's lock to be held
+void mm_drain_deferred(arena_t* a) {
+	if (!__atomic_load_n(&a->deferred, __ATOMIC_RELAXED))
+		return;
+
+	void* p = __atomic_exchange_n(&a->deferred, NULL, __ATOMIC_ACQUIRE);
+	size_t n = 0;
+
+	for (; p; n++) {
+		void* next = *(void**)p;
+
+		if (MM_IS_SLAB(p)) {
+			mm_poison_free_area(p, MM_SLAB(p)->size);
+			mm_slab_free(MM_SLAB(p), p);
+			p = next;
+			continue;
+		}
+
+		header_t* header = MM_HEADER(p);
+		mm_check_canary(header);
+
+		if (mm_check_double_free(MM_IS_FREE(header))) {
+			p = next;
+			continue;
+		}
+
+		mm_poison_free(p);
+		if (!mm_fast_put(a, header))
+			mm_free_block(a, header);
+		p = next;
+	}
+
+	MM_COUNT(deferred_frees, n);
+}
+
+// Returns a slab object or a heap block to its arena
+void mm_free_shared(void* p) {
+	if (MM_IS_SLAB(p)) {
+		slab_t* s = MM_SLAB(p);
+		arena_t* a = s->arena;
+
+		MM_LOCK(a);
+		mm_drain_deferred(a);
+		mm_slab_free(s, p);
+		MM_UNLOCK(a);
+		return;
+	}
+
+	header_t* header = MM_HEADER(p);
+	arena_t* a = mm_arena_of(header);
+
+	MM_LOCK(a);
+	mm_drain_deferred(a);
+	if (!mm_fast_put(a, header))
+		mm_free_block(a, header);
+	MM_RUN_CHECKS(a);
+	MM_UNLOCK(a);
+}
+
+static void* mm_arena_alloc(arena_t* a, size_t size, _Bool* zeroed) {
+	void* p = NULL;
+
+	MM_LOCK(a);
+	mm_drain_deferred(a);
+	if (size <= MM_SLAB_MAX_SIZE)
+		p = mm_slab_alloc(a, MM_ALIGN_UP(size), zeroed);
+	if (!p)
+		p = mm_malloc_block(a, size, zeroed);
+	MM_RUN_CHECKS(a);
+	MM_UNLOCK(a);
+
+	return p;
+}
+
+// Serves the request from the thread cache, or from the shared heap on a miss
+// zeroed, if not NULL, tells whether the payload is known to be all zero
+static void* mm_heap_alloc(size_t size, _Bool* zeroed) {
+	void* p = mm_tcache_get(MM_ALIGN_UP(size));
+
+	if (p) {
+		if (zeroed)
+			*zeroed = 0;
+	} else {
+		arena_t* a = mm_arena_get();
+		p = mm_arena_alloc(a, size, zeroed);
+
+		// An arena whose region is exhausted falls back to the main arena
+		if (!p && a != &mm_main_arena)
+			p = mm_arena_alloc(&mm_main_arena, size, zeroed);
+
+		if (!p)
+			return NULL;
+	}
+
+	if (MM_IS_SLAB(p)) {
+		mm_poison_alloc_area(p, MM_SLAB(p)->size);
+	} else {
+		mm_write_canary(MM_HEADER(p));
+		mm_poison_alloc(p);
+	}
+
+	return p;
+}
+
+// Caches the payload for this thread, or returns it to the shared heap on overflow
+static void mm_heap_free(void* p, size_t size) {
+	if (mm_tcache_put(p, size))
+		return;
+
+	mm_free_shared(p);
+}
+
+static void* mm_malloc(size_t size) {
 	if (size == 0)
 		return NULL;
 
-	if (size >= MMAP_THRESHOLD) {
-		void* p = mm_mmap_alloc(size);
+	if (size >= MM_OPT(mmap_threshold)) {
+		void* p = mm_mmap_alloc(size, NULL);
+		if (!p)
+			return NULL;
+
 		mm_write_canary(MM_HEADER(p));
 		mm_poison_alloc(p);
 
@@ -18,110 +161,227 @@ void* malloc(size_t size) {
 	}
 
 	size = MM_MAX(size, MM_MIN_PAYLOAD);
-	void* p = mm_malloc_block(size);
-	mm_write_canary(MM_HEADER(p));
-	mm_poison_alloc(p);
+	void* p = mm_heap_alloc(size, NULL);
+	if (!p)
+		return NULL;
 
 	mm_add_alloced(size, 0);
 
-	MM_RUN_CHECKS();
 	return p;
 }
 
-void free(void* ptr) {
+static void mm_free(void* ptr) {
 	if (!ptr)
 		return;
 
+	if (MM_IS_SLAB(ptr)) {
+		size_t size = MM_SLAB(ptr)->size;
+		mm_poison_free_area(ptr, size);
+		mm_heap_free(ptr, size);
+		return;
+	}
+
 	header_t* header = MM_HEADER(ptr);
 	mm_check_canary(header);
 
-	// Debug mode check for pointer validity
 #ifdef MM_DEBUG
-	if (((void*)header < mm_heap_start || (void*)header >= mm_heap_end) && !MM_IS_MMAP(header)) {
-		fprintf(stderr, "Ptr is not in the accepted range\n");
-		fflush(stderr);
-		MM_ABORT();
-	}
+	if (!MM_IS_MMAP(header))
+		mm_check_range(mm_arena_of(header), header);
 #endif
 
 	mm_poison_free(ptr);
 
 	if (MM_IS_MMAP(header)) {
+		mm_adjust_mmap_threshold(MM_GET_SIZE(header));
 		mm_mmap_free(header);
 		return;
 	}
 
-	// Double free check
-	if (MM_IS_FREE(header)) {
+	if (mm_check_double_free(MM_IS_FREE(header)))
+		return;
+
+	mm_heap_free(ptr, MM_GET_SIZE(header));
+}
+
+size_t malloc_usable_size(void* ptr) {
+	if (!ptr)
+		return 0;
+
+	if (MM_IS_SLAB(ptr))
+		return MM_SLAB(ptr)->size;
+
+	// A heap block also owns the next header's prev_foot
+	header_t* h = MM_HEADER(ptr);
+	return MM_GET_SIZE(h) + (MM_IS_MMAP(h) ? 0 : MM_SPILL);
+}
+
 #ifdef MM_DEBUG
-		fprintf(stderr, "Double free detected\n");
+// Any size up to the block's is accepted, an in-place realloc can leave a block bigger than its size
+static void mm_check_sized(void* ptr, size_t size) {
+	if (size == 0 || size > malloc_usable_size(ptr)) {
+		fprintf(stderr, "Size %zu doesn't match the block at %p\n", size, ptr);
 		fflush(stderr);
 		MM_ABORT();
-#else
+	}
+}
+#endif
+
+// size must be the size the block was allocated or last reallocated with
+// The size is only checked, never used: a slab object's bin has to come from its run's class,
+// a block that was shrunk in place is bigger than its size, and a heap block's header
+// is loaded anyway to tell it from an mmap chunk
+void free_sized(void* ptr, size_t size) {
+	MM_LATENCY_SCOPE(MM_LATENCY_FREE);
+	if (!ptr)
 		return;
+
+	mm_trace(MM_TRACE_FREE, ptr, NULL, 0);
+	mm_profile_free(ptr);
+
+#ifdef MM_DEBUG
+	mm_check_sized(ptr, size);
+#else
+	(void)size;
 #endif
-	}
 
-	header->size = MM_SET_FREE(header->size);
-	mm_coalesce_prev(&header);
-	mm_coalesce_next(header);
-	mm_add_to_free(header);
+	mm_free(ptr);
+}
 
-	MM_RUN_CHECKS();
+void free_aligned_sized(void* ptr, size_t alignment, size_t size) {
+	MM_LATENCY_SCOPE(MM_LATENCY_FREE);
+	if (!ptr)
+		return;
+
+	mm_trace(MM_TRACE_FREE, ptr, NULL, 0);
+	mm_profile_free(ptr);
+
+#ifdef MM_DEBUG
+	if (!alignment || (uintptr_t)ptr % alignment) {
+		fprintf(stderr, "Ptr %p is not aligned to %zu\n", ptr, alignment);
+		fflush(stderr);
+		MM_ABORT();
+	}
+	mm_check_sized(ptr, size);
+#else
+	(void)alignment;
+	(void)size;
+#endif
+
+	mm_free(ptr);
 }
 
-void* realloc(void* ptr, size_t size) {
+static void* mm_realloc(void* ptr, size_t size) {
 	if (size == 0) {
-		free(ptr);
+		mm_free(ptr);
 		return NULL;
 	}
 
 	// Realloc acts as malloc if no pointer is provided
 	if (!ptr)
-		return malloc(size);
+		return mm_malloc(size);
+
+	// Slab objects can't be resized in place past their class
+	if (MM_IS_SLAB(ptr)) {
+		size_t old_size = MM_SLAB(ptr)->size;
+		if (MM_ALIGN_UP(size) <= old_size)
+			return ptr;
+
+		void* new_ptr = mm_malloc(size);
+		if (!new_ptr)
+			return NULL;
+
+		memcpy(new_ptr, ptr, old_size);
+		mm_free(ptr);
+
+		return new_ptr;
+	}
 
 	header_t* header = MM_HEADER(ptr);
 	size_t old_size = MM_GET_SIZE(header);
-	size = MM_ALIGN_UP(size);
 
-	if (size == old_size) {
+	if (MM_IS_MMAP(header)) {
+		void* new_ptr = mm_mmap_realloc(header, size);
+		if (!new_ptr)
+			return NULL;
+
+		header = MM_HEADER(new_ptr);
+		if (MM_GET_SIZE(header) > old_size) {
+			mm_poison_alloc_area((uint8_t*)new_ptr + old_size, MM_GET_SIZE(header) - old_size);
+			mm_add_alloced(MM_GET_SIZE(header) - old_size, 1);
+		}
+		mm_write_canary(header);
+
+		return new_ptr;
+	}
+
+	// Rounding would wrap, and no heap or mapping could hold it anyway
+	if (size > PTRDIFF_MAX)
+		return NULL;
+
+	size_t new_size = MM_BLOCK_SIZE(size);
+	if (new_size == old_size) {
 		// No change in size
 		return ptr;
-	} else if (size < old_size) {
-		mm_shrink_block(header, size, 0);
+	}
+
+	arena_t* a = mm_arena_of(header);
+
+	if (new_size < old_size) {
+		MM_LOCK(a);
+		mm_shrink_block(a, header, new_size, 0);
 
 		mm_write_canary(header);
-		MM_RUN_CHECKS();
+		MM_RUN_CHECKS(a);
+		MM_UNLOCK(a);
 		return ptr;
 	}
 
-	if (mm_grow_block(header, size, 0)) {
+	// A heap block growing past the threshold moves to its own mapping once,
+	// later growth is then handled by mremap
+	if (size >= MM_OPT(mmap_threshold)) {
+		void* new_ptr = mm_mmap_alloc(size, NULL);
+		if (!new_ptr)
+			return NULL;
+
+		mm_write_canary(MM_HEADER(new_ptr));
+		mm_poison_alloc(new_ptr);
+
+		memcpy(new_ptr, ptr, old_size + MM_SPILL);
+		mm_free(ptr);
+
+		mm_add_alloced(size, 1);
+
+		return new_ptr;
+	}
+
+	MM_LOCK(a);
+	if (mm_grow_block(a, header, new_size, 0)) {
 		mm_write_canary(header);
-		mm_add_alloced(size - old_size, 0);
-		MM_RUN_CHECKS();
+		mm_add_alloced(new_size - old_size, 0);
+		MM_RUN_CHECKS(a);
+		MM_UNLOCK(a);
 		return ptr;
 	}
+	MM_UNLOCK(a);
 
 	// In case the next block isn't big enough or isn't free,
-	// malloc_block is called
-	void* new_ptr = mm_malloc_block(size);
+	// a new block is allocated
+	void* new_ptr = mm_heap_alloc(size, NULL);
 	if (!new_ptr)
 		return NULL;
 
-	mm_poison_alloc(new_ptr);
-
-	memcpy(new_ptr, ptr, old_size);
-	free(ptr);
+	memcpy(new_ptr, ptr, old_size + MM_SPILL);
+	mm_free(ptr);
 
 	mm_add_alloced(size, 0);
-	mm_write_canary(MM_HEADER(new_ptr));
-	MM_RUN_CHECKS();
 
 	return new_ptr;
 }
 
 // This is just malloc with memset(0) and a bounds check
-void* calloc(size_t size, size_t n) {
+// The memset is skipped for memory that was never handed out,
+// so fresh mappings keep faulting their pages in lazily
+static void* mm_calloc(size_t size, size_t n) {
 	if (size == 0 || n == 0 || size > SIZE_MAX / n)
 		return NULL;
 
@@ -130,21 +390,426 @@ void* calloc(size_t size, size_t n) {
 		return NULL;
 
 	void* ptr;
-
-	if (tot_size >= MMAP_THRESHOLD) {
-		ptr = mm_mmap_alloc(tot_size);
-		mm_add_alloced(tot_size, 1);
+	_Bool zeroed = 0;
+
+	if (tot_size >= MM_OPT(mmap_threshold)) {
+		ptr = mm_mmap_alloc(tot_size, &zeroed);
+		if (ptr) {
+			mm_write_canary(MM_HEADER(ptr));
+			mm_add_alloced(tot_size, 1);
+		}
 	} else {
-		ptr = mm_malloc_block(tot_size);
-		mm_add_alloced(tot_size, 0);
+		ptr = mm_heap_alloc(size * n, &zeroed);
+		if (ptr)
+			mm_add_alloced(tot_size, 0);
 	}
 
 	if (!ptr)
 		return NULL;
 
-	memset(ptr, 0, tot_size);
-	mm_write_canary(MM_HEADER(ptr));
-	MM_RUN_CHECKS();
+	if (!zeroed)
+		memset(ptr, 0, size * n);
 
 	return ptr;
 }
+
+static MM_TLS size_t mm_requested_pending;
+static MM_TLS size_t mm_usable_pending;
+static MM_TLS unsigned mm_request_count;
+
+// Tallies what rounding up to MM_ALIGNMENT, MM_MIN_PAYLOAD and unsplit blocks costs
+// Only with MM_OPT_WASTE, it looks up every block's usable size
+static inline void mm_count_request(void* p, size_t size) {
+	if (!MM_OPT(waste))
+		return;
+
+	mm_requested_pending += size;
+	mm_usable_pending += malloc_usable_size(p);
+
+	if (++mm_request_count < MM_WASTE_BATCH)
+		return;
+
+	MM_COUNT(requested_bytes, mm_requested_pending);
+	MM_COUNT(usable_bytes, mm_usable_pending);
+	mm_requested_pending = 0;
+	mm_usable_pending = 0;
+	mm_request_count = 0;
+}
+
+// The public entry points record the call once it's known to have happened,
+// frees are recorded before the block can be handed out again
+// Their latency covers the whole call, tracing and profiling included
+void* malloc(size_t size) {
+	MM_LATENCY_SCOPE(MM_LATENCY_MALLOC);
+	void* p = mm_malloc(size);
+	if (p) {
+		mm_count_request(p, size);
+		mm_trace(MM_TRACE_MALLOC, p, NULL, size);
+		mm_profile_alloc(p, size);
+	}
+	return p;
+}
+
+void free(void* ptr) {
+	MM_LATENCY_SCOPE(MM_LATENCY_FREE);
+	if (ptr) {
+		mm_trace(MM_TRACE_FREE, ptr, NULL, 0);
+		mm_profile_free(ptr);
+	}
+	mm_free(ptr);
+}
+
+// mmap chunks have no arena, they're freed right away
+void mm_free_deferred(void* ptr) {
+	if (!ptr)
+		return;
+
+	mm_trace(MM_TRACE_FREE, ptr, NULL, 0);
+	mm_profile_free(ptr);
+
+	arena_t* a;
+	if (MM_IS_SLAB(ptr)) {
+		a = MM_SLAB(ptr)->arena;
+	} else {
+		header_t* header = MM_HEADER(ptr);
+		if (MM_IS_MMAP(header)) {
+			mm_free(ptr);
+			return;
+		}
+
+		a = mm_arena_of(header);
+		mm_check_range(a, header);
+	}
+
+	void* head = __atomic_load_n(&a->deferred, __ATOMIC_RELAXED);
+	do {
+		*(void**)ptr = head;
+	} while (!__atomic_compare_exchange_n(&a->deferred, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// realloc(ptr, 0) is recorded as the free it is
+// Otherwise the record and the old block's sample are taken before the block can be freed
+// and handed out again, the sample is put back if the realloc fails or leaves the block as it was
+void* realloc(void* ptr, size_t size) {
+	MM_LATENCY_SCOPE(MM_LATENCY_REALLOC);
+	if (size == 0 && ptr)
+		mm_trace(MM_TRACE_FREE, ptr, NULL, 0);
+	struct mm_trace_record* rec = size ? mm_trace_reserve() : NULL;
+
+	mm_profile_sample_t old;
+	_Bool sampled = ptr && mm_profile_detach(ptr, &old);
+
+	void* p = mm_realloc(ptr, size);
+	if (!p) {
+		mm_trace_commit(rec, MM_TRACE_REALLOC, NULL, ptr, size);
+		if (sampled && size)
+			mm_profile_restore(&old);
+		return p;
+	}
+
+	mm_count_request(p, size);
+	mm_trace_commit(rec, MM_TRACE_REALLOC, p, ptr, size);
+	if (sampled && p == ptr && size == old.size)
+		mm_profile_restore(&old);
+	else
+		mm_profile_alloc(p, size);
+	return p;
+}
+
+void* calloc(size_t size, size_t n) {
+	MM_LATENCY_SCOPE(MM_LATENCY_CALLOC);
+	void* p = mm_calloc(size, n);
+	if (p) {
+		mm_count_request(p, size * n);
+		mm_trace(MM_TRACE_CALLOC, p, NULL, size * n);
+		mm_profile_alloc(p, size * n);
+	}
+	return p;
+}
+
+// Takes the arena's lock once for the whole batch
+static size_t mm_arena_alloc_batch(arena_t* a, size_t size, size_t n, void** out) {
+	size_t done = 0;
+
+	MM_LOCK(a);
+	mm_drain_deferred(a);
+	if (size <= MM_SLAB_MAX_SIZE) {
+		while (done < n && (out[done] = mm_slab_alloc(a, MM_ALIGN_UP(size), NULL)))
+			done++;
+	}
+	if (done < n)
+		done += mm_malloc_block_batch(a, size, n - done, out + done);
+	MM_RUN_CHECKS(a);
+	MM_UNLOCK(a);
+
+	return done;
+}
+
+// Sizes served by mmap are allocated one by one, the rest skip the thread cache
+size_t mm_malloc_batch(size_t size, size_t n, void** out) {
+	if (size == 0 || n == 0)
+		return 0;
+
+	size_t done = 0;
+	size_t asize = MM_MAX(size, MM_MIN_PAYLOAD);
+
+	if (size >= MM_OPT(mmap_threshold)) {
+		while (done < n && (out[done] = mm_malloc(size)))
+			done++;
+	} else {
+		arena_t* a = mm_arena_get();
+		done = mm_arena_alloc_batch(a, asize, n, out);
+
+		// An arena whose region is exhausted falls back to the main arena
+		if (done < n && a != &mm_main_arena)
+			done += mm_arena_alloc_batch(&mm_main_arena, asize, n - done, out + done);
+
+		for (size_t i = 0; i < done; i++) {
+			void* p = out[i];
+			if (MM_IS_SLAB(p)) {
+				mm_poison_alloc_area(p, MM_SLAB(p)->size);
+			} else {
+				mm_write_canary(MM_HEADER(p));
+				mm_poison_alloc(p);
+			}
+			mm_add_alloced(size, 0);
+		}
+	}
+
+	for (size_t i = 0; i < done; i++) {
+		mm_count_request(out[i], size);
+		mm_trace(MM_TRACE_MALLOC, out[i], NULL, size);
+		mm_profile_alloc(out[i], size);
+	}
+
+	return done;
+}
+
+// In-place heapsort, qsort may allocate
+static void mm_sort_ptrs(void** p, size_t n) {
+	for (size_t end = n, start = n / 2;;) {
+		size_t root;
+		if (start > 0) {
+			root = --start;
+		} else if (end > 1) {
+			void* t = p[0];
+			p[0] = p[--end];
+			p[end] = t;
+			root = 0;
+		} else {
+			return;
+		}
+
+		for (size_t child; (child = 2 * root + 1) < end; root = child) {
+			if (child + 1 < end && (uintptr_t)p[child] < (uintptr_t)p[child + 1])
+				child++;
+			if ((uintptr_t)p[root] >= (uintptr_t)p[child])
+				break;
+
+			void* t = p[root];
+			p[root] = p[child];
+			p[child] = t;
+		}
+	}
+}
+
+// Slab objects and mmap chunks are freed one by one, heap blocks are sorted
+// by address and freed under one lock per arena, merged with their neighbours in the batch
+// ptrs is compacted and sorted in place, freeing doesn't allocate
+void mm_free_batch(void** ptrs, size_t n) {
+	size_t m = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		void* p = ptrs[i];
+		if (!p)
+			continue;
+
+		mm_trace(MM_TRACE_FREE, p, NULL, 0);
+		mm_profile_free(p);
+
+		if (MM_IS_SLAB(p) || MM_IS_MMAP(MM_HEADER(p))) {
+			mm_free(p);
+			continue;
+		}
+
+		header_t* header = MM_HEADER(p);
+		mm_check_canary(header);
+
+#ifdef MM_DEBUG
+		mm_check_range(mm_arena_of(header), header);
+#endif
+
+		if (mm_check_double_free(MM_IS_FREE(header)))
+			continue;
+
+		ptrs[m++] = p;
+	}
+
+	mm_sort_ptrs(ptrs, m);
+
+	// A pointer given twice ends up next to itself
+	size_t k = 0;
+	for (size_t i = 0; i < m; i++) {
+		if (k && mm_check_double_free(ptrs[k - 1] == ptrs[i]))
+			continue;
+		ptrs[k++] = ptrs[i];
+	}
+
+	for (size_t i = 0; i < k;) {
+		arena_t* a = mm_arena_of(MM_HEADER(ptrs[i]));
+		size_t j = i + 1;
+		while (j < k && mm_arena_of(MM_HEADER(ptrs[j])) == a)
+			j++;
+
+		MM_LOCK(a);
+		mm_drain_deferred(a);
+		mm_free_block_batch(a, ptrs + i, j - i);
+		MM_RUN_CHECKS(a);
+		MM_UNLOCK(a);
+
+		i = j;
+	}
+}
+
+static void* mm_arena_alloc_aligned(arena_t* a, size_t size, size_t align) {
+	MM_LOCK(a);
+	mm_drain_deferred(a);
+	void* p = mm_malloc_aligned_block(a, size, align);
+	MM_RUN_CHECKS(a);
+	MM_UNLOCK(a);
+
+	return p;
+}
+
+// align must be a power of two
+static void* mm_memalign(size_t align, size_t size) {
+	if (size == 0)
+		return NULL;
+
+	if (align <= MM_ALIGNMENT)
+		return mm_malloc(size);
+
+	if (size > SIZE_MAX - align - MM_MIN_BLOCK_SPLIT - MM_PAGE_SIZE)
+		return NULL;
+
+	size = MM_ALIGN_UP(MM_MAX(size, MM_MIN_PAYLOAD));
+
+	if (size >= MM_OPT(mmap_threshold) || align >= MM_ALIGNED_MMAP_THRESHOLD) {
+		void* p = mm_mmap_alloc_aligned(size, align);
+		if (!p)
+			return NULL;
+
+		mm_write_canary(MM_HEADER(p));
+		mm_poison_alloc(p);
+
+		mm_add_alloced(size, 1);
+
+		return p;
+	}
+
+	// Slabs only guarantee MM_ALIGNMENT, so aligned blocks skip them and the thread cache
+	arena_t* a = mm_arena_get();
+	void* p = mm_arena_alloc_aligned(a, size, align);
+
+	if (!p && a != &mm_main_arena)
+		p = mm_arena_alloc_aligned(&mm_main_arena, size, align);
+
+	if (!p)
+		return NULL;
+
+	mm_write_canary(MM_HEADER(p));
+	mm_poison_alloc(p);
+
+	mm_add_alloced(size, 0);
+
+	return p;
+}
+
+static void* mm_alloc_aligned(size_t align, size_t size) {
+	void* p = mm_memalign(align, size);
+	if (p) {
+		mm_count_request(p, size);
+		mm_trace(MM_TRACE_MEMALIGN, p, (void*)(uintptr_t)align, size);
+		mm_profile_alloc(p, size);
+	}
+	return p;
+}
+
+static inline _Bool mm_is_pow2(size_t x) { return x && !(x & (x - 1)); }
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+	if (!mm_is_pow2(alignment) || alignment % sizeof(void*))
+		return EINVAL;
+
+	if (size == 0) {
+		*memptr = NULL;
+		return 0;
+	}
+
+	void* p = mm_alloc_aligned(alignment, size);
+	if (!p)
+		return ENOMEM;
+
+	*memptr = p;
+	return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+	if (!mm_is_pow2(alignment)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return mm_alloc_aligned(alignment, size);
+}
+
+// Like glibc, alignments that aren't a power of two are rounded up to one
+void* memalign(size_t alignment, size_t size) {
+	if (alignment > SIZE_MAX / 2 + 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t align = MM_ALIGNMENT;
+	while (align < alignment)
+		align <<= 1;
+
+	return mm_alloc_aligned(align, size);
+}
+
+void* valloc(size_t size) { return mm_alloc_aligned(MM_PAGE_SIZE, size); }
+
+// Rounds the size up to whole pages, pvalloc(0) returns a page
+void* pvalloc(size_t size) {
+	size_t page = MM_PAGE_SIZE;
+	if (size > SIZE_MAX - page)
+		return NULL;
+
+	return mm_alloc_aligned(page, size ? MM_PAGE_ALIGN(size) : page);
+}
+
+// Returns 1 if any memory was given back to the kernel
+// Deferred frees are drained first, so the slab runs they empty are trimmed too
+int mm_trim(size_t pad) {
+	size_t released = 0;
+
+	for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+		arena_t* a = mm_arena_at(i);
+		if (!a)
+			continue;
+
+		MM_LOCK(a);
+		mm_drain_deferred(a);
+		if (a->initialized) {
+			released += mm_trim_arena(a, pad);
+			MM_RUN_CHECKS(a);
+		}
+		MM_UNLOCK(a);
+	}
+
+	released += mm_slab_trim();
+
+	return released != 0;
+}
+
+int malloc_trim(size_t pad) { return mm_trim(pad); }
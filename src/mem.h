@@ -6,6 +6,153 @@ void* malloc(size_t size);
 void free(void* ptr);
 void* realloc(void* ptr, size_t size);
 void* calloc(size_t size, size_t n);
+size_t malloc_usable_size(void* ptr);
+void free_sized(void* ptr, size_t size);
+void free_aligned_sized(void* ptr, size_t alignment, size_t size);
+
+// Allocates n blocks of size bytes into out, returns how many were allocated,
+// fewer than n only if memory ran out
+size_t mm_malloc_batch(size_t size, size_t n, void** out);
+// Frees n pointers, NULLs are skipped
+// ptrs is used as scratch space to sort the blocks, its contents are unspecified on return
+void mm_free_batch(void** ptrs, size_t n);
+// Frees ptr from any thread without taking a lock, the block is handed to
+// its arena and only merged back on the arena's next malloc or free
+void mm_free_deferred(void* ptr);
+
+int posix_memalign(void** memptr, size_t alignment, size_t size);
+void* aligned_alloc(size_t alignment, size_t size);
+void* memalign(size_t alignment, size_t size);
+void* valloc(size_t size);
+void* pvalloc(size_t size);
+
+#define MM_OPT_MMAP_THRESHOLD 1
+#define MM_OPT_INITIAL_HEAP_SIZE 2
+#define MM_OPT_GROWTH_FACTOR 3
+#define MM_OPT_TRIM_THRESHOLD 4
+#define MM_OPT_TRIM_PAD 5
+#define MM_OPT_MMAP_CACHE_MAX_CHUNKS 6
+#define MM_OPT_MMAP_CACHE_MAX_BYTES 7
+#define MM_OPT_MMAP_CACHE_MAX_AGE_MS 8
+#define MM_OPT_DYNAMIC_MMAP 9
+#define MM_OPT_GROWTH_MAX_STEP 10
+#define MM_OPT_THP 11
+#define MM_OPT_HEAP_RESERVE 12
+#define MM_OPT_FAST_MAX_SIZE 13
+#define MM_OPT_PROFILE 14
+#define MM_OPT_PROFILE_RATE 15
+#define MM_OPT_WASTE 16
+
+int mm_mallopt(int param, size_t value);
+int mallopt(int param, int value);
+
+int mm_trim(size_t pad);
+int malloc_trim(size_t pad);
+
+// Writes the sampled live and cumulative heap profile to path in pprof's legacy heap format
+// Returns 1 on success, 0 if the file couldn't be written
+int mm_profile_dump(const char* path);
+
+struct mm_mmap_cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions;
+	size_t cached_bytes;
+	size_t cached_chunks;
+};
+
+void mm_get_mmap_cache_stats(struct mm_mmap_cache_stats* s);
+
+// Free list bytes are reported per power-of-two size class,
+// class 0 holds blocks below 256 bytes, class i blocks of [128 << i, 256 << i)
+#define MM_STATS_FREE_CLASSES 24
+
+struct mm_stats {
+	size_t in_use_bytes;
+	size_t heap_bytes;
+	size_t heap_free_bytes;
+	size_t heap_top_bytes;
+	size_t heap_free_blocks;
+	size_t heap_fast_blocks;
+	size_t heap_fast_bytes;
+	size_t deferred_frees;
+	size_t free_class_bytes[MM_STATS_FREE_CLASSES];
+	size_t slab_bytes;
+	size_t slab_used_bytes;
+	size_t mmap_bytes;
+	size_t mmap_chunks;
+	size_t mmap_cached_bytes;
+	size_t grows;
+	size_t trims;
+	size_t mprotect_calls;
+	size_t mmap_calls;
+	size_t munmap_calls;
+	size_t mremap_calls;
+	size_t madvise_calls;
+	size_t heap_segments;
+	size_t thp_bytes;
+};
+
+// Same layout as glibc's struct mallinfo2, mallinfo2() is exported as well
+struct mm_mallinfo2 {
+	size_t arena;
+	size_t ordblks;
+	size_t smblks;
+	size_t hblks;
+	size_t hblkhd;
+	size_t usmblks;
+	size_t fsmblks;
+	size_t uordblks;
+	size_t fordblks;
+	size_t keepcost;
+};
+
+void mm_get_stats(struct mm_stats* s);
+struct mm_mallinfo2 mm_mallinfo2(void);
+
+// Bytes of the whole process actually backed by transparent huge pages,
+// read from /proc/self/smaps_rollup, 0 if it can't be read
+size_t mm_thp_backed_bytes(void);
+
+// Writes a JSON report of the heap layout to buf, which is always terminated if len isn't 0
+// Returns the length of the whole report, like snprintf
+size_t mm_heap_analyze(char* buf, size_t len);
+
+// Latency histograms, only recorded in builds with -DMM_LATENCY
+// Values are timestamp counter ticks, or nanoseconds where there is no counter
+// Buckets are log-linear: values below 8 have their own bucket, above that
+// every power of two is split into 8 buckets, the last one holds everything beyond
+#define MM_LATENCY_BUCKETS 256
+
+#define MM_LATENCY_MALLOC 0
+#define MM_LATENCY_FREE 1
+#define MM_LATENCY_REALLOC 2
+#define MM_LATENCY_CALLOC 3
+#define MM_LATENCY_GROW_HEAP 4
+#define MM_LATENCY_MMAP_ALLOC 5
+#define MM_LATENCY_MMAP_FREE 6
+#define MM_LATENCY_OPS 7
+
+struct mm_latency_hist {
+	size_t count;
+	size_t sum;
+	size_t max;
+	size_t buckets[MM_LATENCY_BUCKETS];
+};
+
+struct mm_latency_stats {
+	struct mm_latency_hist ops[MM_LATENCY_OPS];
+	// Free list blocks looked at per free list search, in blocks instead of ticks
+	struct mm_latency_hist find_fit_scan;
+};
+
+// Returns 0 and zeroes s if latencies aren't recorded in this build
+int mm_get_latency_stats(struct mm_latency_stats* s);
+void mm_reset_latency_stats(void);
+// The smallest value counted in bucket i
+size_t mm_latency_bucket_min(size_t i);
+// The smallest value of the bucket holding the q-th quantile, q in [0, 1]
+size_t mm_latency_quantile(const struct mm_latency_hist* h, double q);
 
 void mm_print_alloced(void);
 void mm_print_free(void);
@@ -0,0 +1,180 @@
+#include "interface.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+ * Cached chunks keep their node in their first bytes
+ * Bucket i holds chunks of [2^i, 2^(i + 1)) pages, newest first
+ */
+typedef struct mmap_chunk {
+	struct mmap_chunk* next;
+	size_t len;
+	uint64_t stamp;
+} mmap_chunk_t;
+
+pthread_mutex_t mm_mmap_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mmap_chunk_t* mm_mmap_buckets[MM_MMAP_CACHE_BUCKETS];
+static size_t mm_mmap_cached_bytes = 0;
+static size_t mm_mmap_cached_chunks = 0;
+static size_t mm_mmap_hits = 0;
+static size_t mm_mmap_misses = 0;
+static size_t mm_mmap_evictions = 0;
+
+static uint64_t mm_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static size_t mm_mmap_bucket(size_t len) {
+	size_t pages = len / MM_PAGE_SIZE;
+	size_t i = sizeof(size_t) * 8 - 1 - __builtin_clzll(pages);
+
+	return i < MM_MMAP_CACHE_BUCKETS ? i : MM_MMAP_CACHE_BUCKETS - 1;
+}
+
+// Unlinks every chunk older than the maximum age onto the evicted list
+static mmap_chunk_t* mm_mmap_expire(uint64_t now, mmap_chunk_t* evicted) {
+	uint64_t max_age = MM_OPT(mmap_cache_max_age_ms);
+
+	for (size_t i = 0; i < MM_MMAP_CACHE_BUCKETS; i++) {
+		mmap_chunk_t** cur = &mm_mmap_buckets[i];
+		while (*cur) {
+			mmap_chunk_t* c = *cur;
+			if (now - c->stamp < max_age) {
+				cur = &c->next;
+				continue;
+			}
+
+			*cur = c->next;
+			c->next = evicted;
+			evicted = c;
+
+			mm_mmap_cached_bytes -= c->len;
+			mm_mmap_cached_chunks--;
+			mm_mmap_evictions++;
+		}
+	}
+
+	return evicted;
+}
+
+// Unlinks the oldest chunk onto the evicted list
+static mmap_chunk_t* mm_mmap_evict_oldest(mmap_chunk_t* evicted) {
+	mmap_chunk_t** oldest = NULL;
+
+	for (size_t i = 0; i < MM_MMAP_CACHE_BUCKETS; i++) {
+		for (mmap_chunk_t** cur = &mm_mmap_buckets[i]; *cur; cur = &(*cur)->next) {
+			if (!oldest || (*cur)->stamp < (*oldest)->stamp)
+				oldest = cur;
+		}
+	}
+
+	if (!oldest)
+		return evicted;
+
+	mmap_chunk_t* c = *oldest;
+	*oldest = c->next;
+	c->next = evicted;
+
+	mm_mmap_cached_bytes -= c->len;
+	mm_mmap_cached_chunks--;
+	mm_mmap_evictions++;
+
+	return c;
+}
+
+// The syscalls happen after mm_mmap_cache_lock is dropped
+static void mm_mmap_unmap_all(mmap_chunk_t* c) {
+	while (c) {
+		mmap_chunk_t* next = c->next;
+		MM_COUNT(munmap_calls, 1);
+		if (munmap(c, c->len) == -1) {
+#ifdef MM_DEBUG
+			perror("munmap");
+#endif
+		}
+		c = next;
+	}
+}
+
+// Takes a cached chunk of at least *len bytes and at most twice that,
+// *len is updated to the length of the chunk
+void* mm_mmap_cache_get(size_t* len) {
+	size_t want = *len;
+	mmap_chunk_t* found = NULL;
+	mmap_chunk_t* evicted = NULL;
+
+	pthread_mutex_lock(&mm_mmap_cache_lock);
+	evicted = mm_mmap_expire(mm_now_ms(), evicted);
+
+	for (size_t i = mm_mmap_bucket(want); i < MM_MMAP_CACHE_BUCKETS && !found; i++) {
+		for (mmap_chunk_t** cur = &mm_mmap_buckets[i]; *cur; cur = &(*cur)->next) {
+			mmap_chunk_t* c = *cur;
+			if (c->len < want || c->len / 2 > want)
+				continue;
+
+			*cur = c->next;
+			found = c;
+			break;
+		}
+	}
+
+	if (found) {
+		mm_mmap_cached_bytes -= found->len;
+		mm_mmap_cached_chunks--;
+		mm_mmap_hits++;
+		*len = found->len;
+	} else {
+		mm_mmap_misses++;
+	}
+	pthread_mutex_unlock(&mm_mmap_cache_lock);
+
+	mm_mmap_unmap_all(evicted);
+	return found;
+}
+
+// Returns 0 if the chunk doesn't fit in the cache and should be unmapped
+_Bool mm_mmap_cache_put(void* p, size_t len) {
+	size_t max_chunks = MM_OPT(mmap_cache_max_chunks);
+	size_t max_bytes = MM_OPT(mmap_cache_max_bytes);
+
+	if (!max_chunks || len > max_bytes)
+		return 0;
+
+	uint64_t now = mm_now_ms();
+	mmap_chunk_t* c = p;
+	mmap_chunk_t* evicted = NULL;
+
+	pthread_mutex_lock(&mm_mmap_cache_lock);
+	evicted = mm_mmap_expire(now, evicted);
+
+	while (mm_mmap_cached_chunks >= max_chunks || mm_mmap_cached_bytes + len > max_bytes)
+		evicted = mm_mmap_evict_oldest(evicted);
+
+	size_t i = mm_mmap_bucket(len);
+	c->len = len;
+	c->stamp = now;
+	c->next = mm_mmap_buckets[i];
+	mm_mmap_buckets[i] = c;
+
+	mm_mmap_cached_bytes += len;
+	mm_mmap_cached_chunks++;
+	pthread_mutex_unlock(&mm_mmap_cache_lock);
+
+	mm_mmap_unmap_all(evicted);
+	return 1;
+}
+
+void mm_get_mmap_cache_stats(struct mm_mmap_cache_stats* s) {
+	pthread_mutex_lock(&mm_mmap_cache_lock);
+	s->hits = mm_mmap_hits;
+	s->misses = mm_mmap_misses;
+	s->evictions = mm_mmap_evictions;
+	s->cached_bytes = mm_mmap_cached_bytes;
+	s->cached_chunks = mm_mmap_cached_chunks;
+	pthread_mutex_unlock(&mm_mmap_cache_lock);
+}
@@ -0,0 +1,171 @@
+#include "interface.h"
+
+#include <stdlib.h>
+
+mm_options_t mm_opts = {
+	.mmap_threshold = MMAP_THRESHOLD,
+	.initial_heap_size = MM_INITIAL_HEAP_SIZE,
+	.growth_factor = MM_GROWTH_FACTOR,
+	.growth_max_step = MM_GROWTH_MAX_STEP,
+	.trim_threshold = MM_TRIM_THRESHOLD,
+	.trim_pad = MM_TRIM_PAD,
+	.mmap_cache_max_chunks = MM_MMAP_CACHE_MAX_CHUNKS,
+	.mmap_cache_max_bytes = MM_MMAP_CACHE_MAX_BYTES,
+	.mmap_cache_max_age_ms = MM_MMAP_CACHE_MAX_AGE_MS,
+	.dynamic_mmap = 1,
+	.thp = 0,
+	.heap_reserve = MM_HEAP_RESERVE,
+	.fast_max_size = MM_FAST_MAX_SIZE,
+	.profile = 0,
+	.profile_rate = MM_PROFILE_RATE,
+	.waste = 0,
+};
+
+static pthread_once_t mm_options_once = PTHREAD_ONCE_INIT;
+
+static const struct {
+	const char* name;
+	int param;
+} mm_env_options[] = {
+	{"MM_MMAP_THRESHOLD", MM_OPT_MMAP_THRESHOLD},
+	{"MM_INITIAL_HEAP_SIZE", MM_OPT_INITIAL_HEAP_SIZE},
+	{"MM_GROWTH_FACTOR", MM_OPT_GROWTH_FACTOR},
+	{"MM_GROWTH_MAX_STEP", MM_OPT_GROWTH_MAX_STEP},
+	{"MM_TRIM_THRESHOLD", MM_OPT_TRIM_THRESHOLD},
+	{"MM_TRIM_PAD", MM_OPT_TRIM_PAD},
+	{"MM_MMAP_CACHE_MAX_CHUNKS", MM_OPT_MMAP_CACHE_MAX_CHUNKS},
+	{"MM_MMAP_CACHE_MAX_BYTES", MM_OPT_MMAP_CACHE_MAX_BYTES},
+	{"MM_MMAP_CACHE_MAX_AGE_MS", MM_OPT_MMAP_CACHE_MAX_AGE_MS},
+	{"MM_DYNAMIC_MMAP", MM_OPT_DYNAMIC_MMAP},
+	{"MM_THP", MM_OPT_THP},
+	{"MM_HEAP_RESERVE", MM_OPT_HEAP_RESERVE},
+	{"MM_FAST_MAX_SIZE", MM_OPT_FAST_MAX_SIZE},
+	{"MM_PROFILE", MM_OPT_PROFILE},
+	{"MM_PROFILE_RATE", MM_OPT_PROFILE_RATE},
+	{"MM_WASTE", MM_OPT_WASTE},
+};
+
+static inline void mm_opt_store(size_t* opt, size_t value) { __atomic_store_n(opt, value, __ATOMIC_RELAXED); }
+
+// getenv doesn't allocate, so this is safe from inside malloc
+static void mm_read_env(void) {
+	for (size_t i = 0; i < sizeof(mm_env_options) / sizeof(mm_env_options[0]); i++) {
+		const char* s = getenv(mm_env_options[i].name);
+		if (!s || !*s)
+			continue;
+
+		char* end;
+		unsigned long long v = strtoull(s, &end, 0);
+		if (*end)
+			continue;
+
+		mm_mallopt(mm_env_options[i].param, (size_t)v);
+	}
+}
+
+void mm_init_options(void) { pthread_once(&mm_options_once, mm_read_env); }
+
+// Allocations made before constructors run read the environment themselves
+__attribute__((constructor)) static void mm_options_ctor(void) { mm_init_options(); }
+
+// Returns 1 on success, 0 for an unknown parameter or an invalid value
+int mm_mallopt(int param, size_t value) {
+	switch (param) {
+	case MM_OPT_MMAP_THRESHOLD:
+		if (value == 0 || value > MM_MMAP_THRESHOLD_MAX)
+			return 0;
+		mm_opt_store(&mm_opts.mmap_threshold, value);
+		mm_opt_store(&mm_opts.dynamic_mmap, 0);
+		return 1;
+	case MM_OPT_INITIAL_HEAP_SIZE:
+		if (value < MM_METADATA_SIZE + MM_MIN_SPLIT || value > MM_ARENA_REGION_SIZE / 2)
+			return 0;
+		mm_opt_store(&mm_opts.initial_heap_size, MM_ALIGN_UP(value));
+		return 1;
+	case MM_OPT_GROWTH_FACTOR:
+		if (value < 2)
+			return 0;
+		mm_opt_store(&mm_opts.growth_factor, value);
+		return 1;
+	case MM_OPT_GROWTH_MAX_STEP:
+		if (value < (size_t)MM_PAGE_SIZE)
+			return 0;
+		mm_opt_store(&mm_opts.growth_max_step, value);
+		return 1;
+	case MM_OPT_TRIM_THRESHOLD:
+		mm_opt_store(&mm_opts.trim_threshold, value);
+		mm_opt_store(&mm_opts.dynamic_mmap, 0);
+		return 1;
+	case MM_OPT_TRIM_PAD:
+		mm_opt_store(&mm_opts.trim_pad, value);
+		mm_opt_store(&mm_opts.dynamic_mmap, 0);
+		return 1;
+	case MM_OPT_MMAP_CACHE_MAX_CHUNKS:
+		mm_opt_store(&mm_opts.mmap_cache_max_chunks, value);
+		return 1;
+	case MM_OPT_MMAP_CACHE_MAX_BYTES:
+		mm_opt_store(&mm_opts.mmap_cache_max_bytes, value);
+		return 1;
+	case MM_OPT_MMAP_CACHE_MAX_AGE_MS:
+		mm_opt_store(&mm_opts.mmap_cache_max_age_ms, value);
+		return 1;
+	case MM_OPT_DYNAMIC_MMAP:
+		mm_opt_store(&mm_opts.dynamic_mmap, value != 0);
+		return 1;
+	case MM_OPT_THP:
+		mm_opt_store(&mm_opts.thp, value != 0);
+		return 1;
+	case MM_OPT_HEAP_RESERVE:
+		if (value < MM_HUGE_PAGE_SIZE || value > PTRDIFF_MAX / 2)
+			return 0;
+		mm_opt_store(&mm_opts.heap_reserve, MM_HUGE_ALIGN(value));
+		return 1;
+	case MM_OPT_FAST_MAX_SIZE:
+		if (value > MM_FAST_BINS * MM_ALIGNMENT)
+			return 0;
+		mm_opt_store(&mm_opts.fast_max_size, value);
+		return 1;
+	case MM_OPT_PROFILE:
+		mm_opt_store(&mm_opts.profile, value != 0);
+		return 1;
+	case MM_OPT_PROFILE_RATE:
+		if (value == 0 || value > PTRDIFF_MAX / 64)
+			return 0;
+		mm_opt_store(&mm_opts.profile_rate, value);
+		return 1;
+	case MM_OPT_WASTE:
+		mm_opt_store(&mm_opts.waste, value != 0);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// glibc's parameter numbers, for programs tuning it through mallopt
+int mallopt(int param, int value) {
+	if (value < 0)
+		return 0;
+
+	switch (param) {
+	case 1: // M_MXFAST
+		return mm_mallopt(MM_OPT_FAST_MAX_SIZE, (size_t)value);
+	case -1: // M_TRIM_THRESHOLD
+		return mm_mallopt(MM_OPT_TRIM_THRESHOLD, (size_t)value);
+	case -2: // M_TOP_PAD
+		return mm_mallopt(MM_OPT_TRIM_PAD, (size_t)value);
+	case -3: // M_MMAP_THRESHOLD
+		return mm_mallopt(MM_OPT_MMAP_THRESHOLD, (size_t)value);
+	default:
+		return 0;
+	}
+}
+
+// Freeing an mmap chunk bigger than the threshold means blocks of that size
+// are short-lived, so they move to the heap from now on, like in glibc
+void mm_adjust_mmap_threshold(size_t size) {
+	if (!MM_OPT(dynamic_mmap) || size <= MM_OPT(mmap_threshold) || size > MM_MMAP_THRESHOLD_MAX)
+		return;
+
+	mm_opt_store(&mm_opts.mmap_threshold, size);
+	mm_opt_store(&mm_opts.trim_threshold, 2 * size);
+}
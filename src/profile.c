@@ -0,0 +1,408 @@
+#include "interface.h"
+
+#include <execinfo.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * Sampling heap profiler
+ *
+ * Dumps are written in pprof's legacy heap format, heap_v2 carries the
+ * sampling rate, so pprof scales every sample back up by itself:
+ *   heap profile: <live objs>: <live bytes> [<objs>: <bytes>] @ heap_v2/<rate>
+ *   <live objs>: <live bytes> [<objs>: <bytes>] @ <pc> <pc> ...
+ *   # dropped samples: <n>
+ *   MAPPED_LIBRARIES:
+ *   <the contents of /proc/self/maps>
+ *
+ * The bracketed numbers are cumulative, every sample ever taken on that stack
+ * Samples that didn't fit in the tables are only counted, pprof skips the comment line
+ */
+
+// The profiler's own frame and the public entry point
+#define MM_PROFILE_SKIP 2
+
+typedef struct mm_profile_bucket {
+	uint64_t hash;
+	size_t depth;
+	void* pcs[MM_PROFILE_DEPTH];
+	size_t live_objs;
+	size_t live_bytes;
+	size_t objs;
+	size_t bytes;
+} mm_profile_bucket_t;
+
+MM_TLS ptrdiff_t mm_profile_left;
+size_t mm_profile_live;
+
+static MM_TLS uint64_t mm_profile_rand;
+static MM_TLS _Bool mm_profile_busy;
+static MM_TLS _Bool mm_profile_started;
+
+static pthread_mutex_t mm_profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t mm_profile_once = PTHREAD_ONCE_INIT;
+static mm_profile_bucket_t* mm_profile_buckets;
+static mm_profile_sample_t* mm_profile_samples;
+static uint16_t* mm_profile_filter;
+static size_t mm_profile_bucket_count;
+static size_t mm_profile_sample_count;
+static size_t mm_profile_dropped;
+
+// ln x for x in (0, 1], to about 1e-6, the allocator doesn't link libm
+static double mm_profile_log(double x) {
+	int e = 0;
+	while (x < 0.5) {
+		x *= 2;
+		e++;
+	}
+
+	// ln x = 2 atanh(z), |z| <= 1/3 here
+	double z = (x - 1) / (x + 1);
+	double z2 = z * z;
+	double l = 2 * z * (1 + z2 * (1.0 / 3 + z2 * (1.0 / 5 + z2 * (1.0 / 7 + z2 / 9))));
+
+	return l - e * 0.6931471805599453;
+}
+
+// Bytes until the next sample, exponentially distributed around the rate
+static ptrdiff_t mm_profile_interval(void) {
+	// xorshift64, seeded per thread by the address of its state
+	uint64_t x = mm_profile_rand;
+	if (!x)
+		x = (uint64_t)(uintptr_t)&mm_profile_rand * 0x9E3779B97F4A7C15ull | 1;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	mm_profile_rand = x;
+
+	double u = (double)((x >> 11) + 1) * 0x1p-53;
+	return (ptrdiff_t)(-mm_profile_log(u) * (double)MM_OPT(profile_rate));
+}
+
+static inline size_t mm_profile_slot(void* p) {
+	return (size_t)(((uintptr_t)p >> 4) * 0x9E3779B97F4A7C15ull >> 32);
+}
+
+static void* mm_profile_map(size_t len) {
+	void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+#ifdef MM_DEBUG
+		perror("mmap");
+#endif
+		return NULL;
+	}
+	return p;
+}
+
+// Tables are only mapped once something is sampled, they're touched lazily
+static void mm_profile_init(void) {
+	mm_profile_bucket_t* buckets = mm_profile_map(MM_PROFILE_BUCKETS * sizeof(mm_profile_bucket_t));
+	mm_profile_sample_t* samples = mm_profile_map(MM_PROFILE_SAMPLES * sizeof(mm_profile_sample_t));
+	uint16_t* filter = mm_profile_map(MM_PROFILE_FILTER * sizeof(uint16_t));
+
+	if (!buckets || !samples || !filter)
+		return;
+
+	mm_profile_buckets = buckets;
+	mm_profile_samples = samples;
+	__atomic_store_n(&mm_profile_filter, filter, __ATOMIC_RELEASE);
+}
+
+// Expects the profiler's lock to be held, returns NULL once the table is 3/4 full
+static mm_profile_bucket_t* mm_profile_bucket(void** pcs, size_t depth) {
+	uint64_t h = 0xCBF29CE484222325ull;
+	for (size_t i = 0; i < depth; i++)
+		h = (h ^ (uintptr_t)pcs[i]) * 0x100000001B3ull;
+	h |= 1;
+
+	for (size_t i = h & (MM_PROFILE_BUCKETS - 1);; i = (i + 1) & (MM_PROFILE_BUCKETS - 1)) {
+		mm_profile_bucket_t* b = &mm_profile_buckets[i];
+
+		if (b->hash == h && b->depth == depth && !memcmp(b->pcs, pcs, depth * sizeof(void*)))
+			return b;
+
+		if (!b->hash) {
+			if (4 * (mm_profile_bucket_count + 1) > 3 * MM_PROFILE_BUCKETS)
+				return NULL;
+
+			b->hash = h;
+			b->depth = depth;
+			memcpy(b->pcs, pcs, depth * sizeof(void*));
+			mm_profile_bucket_count++;
+			return b;
+		}
+	}
+}
+
+static mm_profile_sample_t* mm_profile_find(void* p) {
+	for (size_t i = mm_profile_slot(p) & (MM_PROFILE_SAMPLES - 1);; i = (i + 1) & (MM_PROFILE_SAMPLES - 1)) {
+		if (mm_profile_samples[i].ptr == p)
+			return &mm_profile_samples[i];
+		if (!mm_profile_samples[i].ptr)
+			return NULL;
+	}
+}
+
+static inline uint16_t* mm_profile_counter(void* p) { return &mm_profile_filter[mm_profile_slot(p) & (MM_PROFILE_FILTER - 1)]; }
+
+// Expects the profiler's lock to be held, shifts entries back like the replay tool's table
+static void mm_profile_remove(mm_profile_sample_t* s) {
+	mm_profile_bucket_t* b = s->bucket;
+	b->live_objs--;
+	b->live_bytes -= s->size;
+
+	uint16_t* c = mm_profile_counter(s->ptr);
+	__atomic_store_n(c, *c - 1, __ATOMIC_RELAXED);
+	mm_profile_sample_count--;
+	__atomic_fetch_sub(&mm_profile_live, 1, __ATOMIC_RELAXED);
+
+	size_t hole = (size_t)(s - mm_profile_samples);
+	for (size_t i = (hole + 1) & (MM_PROFILE_SAMPLES - 1); mm_profile_samples[i].ptr;
+	     i = (i + 1) & (MM_PROFILE_SAMPLES - 1)) {
+		size_t home = mm_profile_slot(mm_profile_samples[i].ptr) & (MM_PROFILE_SAMPLES - 1);
+		if (((i - home) & (MM_PROFILE_SAMPLES - 1)) >= ((i - hole) & (MM_PROFILE_SAMPLES - 1))) {
+			mm_profile_samples[hole] = mm_profile_samples[i];
+			hole = i;
+		}
+	}
+	mm_profile_samples[hole].ptr = NULL;
+}
+
+// Expects the profiler's lock to be held and the table to have room
+static void mm_profile_insert(const mm_profile_sample_t* s) {
+	size_t i = mm_profile_slot(s->ptr) & (MM_PROFILE_SAMPLES - 1);
+	while (mm_profile_samples[i].ptr)
+		i = (i + 1) & (MM_PROFILE_SAMPLES - 1);
+	mm_profile_samples[i] = *s;
+
+	uint16_t* c = mm_profile_counter(s->ptr);
+	__atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+	mm_profile_sample_count++;
+	__atomic_fetch_add(&mm_profile_live, 1, __ATOMIC_RELAXED);
+}
+
+// Expects the profiler's lock to be held
+static void mm_profile_record(void* p, size_t size, void** pcs, size_t depth) {
+	// The block's free went by unseen, while its thread was sampling
+	mm_profile_sample_t* s = mm_profile_find(p);
+	if (s)
+		mm_profile_remove(s);
+
+	mm_profile_bucket_t* b = mm_profile_bucket(pcs, depth);
+	if (!b || 4 * (mm_profile_sample_count + 1) > 3 * MM_PROFILE_SAMPLES) {
+		mm_profile_dropped++;
+		return;
+	}
+
+	b->objs++;
+	b->bytes += size;
+	b->live_objs++;
+	b->live_bytes += size;
+
+	mm_profile_insert(&(mm_profile_sample_t){p, size, b});
+}
+
+// Called once the thread's byte count crosses zero
+void mm_profile_sample(void* p, size_t size) {
+	if (mm_profile_busy)
+		return;
+
+	// Off, the count is checked again a rate's worth of bytes later
+	if (!MM_OPT(profile)) {
+		mm_profile_left = (ptrdiff_t)MM_OPT(profile_rate);
+		return;
+	}
+
+	// Every thread's countdown starts at 0, so its first interval is only drawn now,
+	// the allocation is sampled only if it crosses that interval too
+	if (!mm_profile_started) {
+		mm_profile_started = 1;
+		mm_profile_left += mm_profile_interval();
+		if (mm_profile_left >= 0)
+			return;
+	}
+
+	mm_profile_busy = 1;
+	mm_profile_left = mm_profile_interval();
+
+	void* pcs[MM_PROFILE_DEPTH + MM_PROFILE_SKIP];
+	int n = backtrace(pcs, MM_PROFILE_DEPTH + MM_PROFILE_SKIP);
+	size_t depth = n > MM_PROFILE_SKIP ? (size_t)n - MM_PROFILE_SKIP : 0;
+
+	pthread_once(&mm_profile_once, mm_profile_init);
+	if (mm_profile_samples) {
+		pthread_mutex_lock(&mm_profile_lock);
+		mm_profile_record(p, size, pcs + MM_PROFILE_SKIP, depth);
+		pthread_mutex_unlock(&mm_profile_lock);
+	}
+
+	mm_profile_busy = 0;
+}
+
+// Only called while something is sampled, most frees stop at the filter
+// The sample is copied out so realloc can put it back
+_Bool mm_profile_take(void* p, mm_profile_sample_t* out) {
+	if (mm_profile_busy)
+		return 0;
+
+	uint16_t* filter = __atomic_load_n(&mm_profile_filter, __ATOMIC_ACQUIRE);
+	if (!filter || !__atomic_load_n(&filter[mm_profile_slot(p) & (MM_PROFILE_FILTER - 1)], __ATOMIC_RELAXED))
+		return 0;
+
+	pthread_mutex_lock(&mm_profile_lock);
+	mm_profile_sample_t* s = mm_profile_find(p);
+	if (s) {
+		*out = *s;
+		mm_profile_remove(s);
+	}
+	pthread_mutex_unlock(&mm_profile_lock);
+
+	return s != NULL;
+}
+
+void mm_profile_retire(void* p) {
+	mm_profile_sample_t s;
+	mm_profile_take(p, &s);
+}
+
+// Puts back a sample taken by mm_profile_take, its cumulative counts never left the bucket
+void mm_profile_restore(const mm_profile_sample_t* s) {
+	pthread_mutex_lock(&mm_profile_lock);
+
+	if (4 * (mm_profile_sample_count + 1) > 3 * MM_PROFILE_SAMPLES) {
+		mm_profile_dropped++;
+	} else {
+		s->bucket->live_objs++;
+		s->bucket->live_bytes += s->size;
+		mm_profile_insert(s);
+	}
+
+	pthread_mutex_unlock(&mm_profile_lock);
+}
+
+typedef struct mm_profile_out {
+	int fd;
+	size_t pos;
+	_Bool failed;
+	char buf[4096];
+} mm_profile_out_t;
+
+static void mm_profile_flush(mm_profile_out_t* o) {
+	for (size_t done = 0; done < o->pos && !o->failed;) {
+		ssize_t n = write(o->fd, o->buf + done, o->pos - done);
+		if (n <= 0)
+			o->failed = 1;
+		else
+			done += (size_t)n;
+	}
+	o->pos = 0;
+}
+
+// Lines are far shorter than the buffer
+__attribute__((format(printf, 2, 3))) static void mm_profile_printf(mm_profile_out_t* o, const char* fmt, ...) {
+	if (sizeof(o->buf) - o->pos < 1024)
+		mm_profile_flush(o);
+
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(o->buf + o->pos, sizeof(o->buf) - o->pos, fmt, ap);
+	va_end(ap);
+
+	if (n > 0)
+		o->pos += MM_MIN((size_t)n, sizeof(o->buf) - o->pos - 1);
+}
+
+// pprof symbolizes the stacks with the mappings
+static void mm_profile_maps(mm_profile_out_t* o) {
+	mm_profile_printf(o, "\nMAPPED_LIBRARIES:\n");
+
+	int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	for (;;) {
+		mm_profile_flush(o);
+		ssize_t n = read(fd, o->buf, sizeof(o->buf));
+		if (n <= 0)
+			break;
+		o->pos = (size_t)n;
+	}
+
+	close(fd);
+}
+
+int mm_profile_dump(const char* path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+#ifdef MM_DEBUG
+		perror("open");
+#endif
+		return 0;
+	}
+
+	// Nothing allocated while the lock is held may be sampled or retired
+	_Bool busy = mm_profile_busy;
+	mm_profile_busy = 1;
+
+	mm_profile_out_t o = {.fd = fd};
+	size_t live_objs = 0, live_bytes = 0, objs = 0, bytes = 0;
+
+	pthread_mutex_lock(&mm_profile_lock);
+
+	for (size_t i = 0; mm_profile_buckets && i < MM_PROFILE_BUCKETS; i++) {
+		mm_profile_bucket_t* b = &mm_profile_buckets[i];
+		live_objs += b->live_objs;
+		live_bytes += b->live_bytes;
+		objs += b->objs;
+		bytes += b->bytes;
+	}
+
+	mm_profile_printf(&o, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_objs, live_bytes, objs, bytes,
+	                  MM_OPT(profile_rate));
+
+	for (size_t i = 0; mm_profile_buckets && i < MM_PROFILE_BUCKETS; i++) {
+		mm_profile_bucket_t* b = &mm_profile_buckets[i];
+		if (!b->objs)
+			continue;
+
+		mm_profile_printf(&o, "%zu: %zu [%zu: %zu] @", b->live_objs, b->live_bytes, b->objs, b->bytes);
+		for (size_t d = 0; d < b->depth; d++)
+			mm_profile_printf(&o, " %p", b->pcs[d]);
+		mm_profile_printf(&o, "\n");
+	}
+
+	mm_profile_printf(&o, "# dropped samples: %zu\n", mm_profile_dropped);
+
+	pthread_mutex_unlock(&mm_profile_lock);
+
+	mm_profile_maps(&o);
+	mm_profile_flush(&o);
+	mm_profile_busy = busy;
+
+	_Bool ok = !o.failed;
+	if (close(fd) == -1)
+		ok = 0;
+
+	return ok;
+}
+
+// The child may inherit the lock held by a thread that no longer exists
+static void mm_profile_prepare(void) { pthread_mutex_lock(&mm_profile_lock); }
+static void mm_profile_release(void) { pthread_mutex_unlock(&mm_profile_lock); }
+
+// backtrace() loads libgcc the first time, which allocates, so that's done here
+// pthread_atfork may allocate too
+__attribute__((constructor)) static void mm_profile_ctor(void) {
+	pthread_atfork(mm_profile_prepare, mm_profile_release, mm_profile_release);
+
+	mm_init_options();
+	if (MM_OPT(profile)) {
+		void* pc;
+		mm_profile_busy = 1;
+		backtrace(&pc, 1);
+		mm_profile_busy = 0;
+	}
+}
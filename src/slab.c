@@ -0,0 +1,226 @@
+#include "interface.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+uintptr_t mm_slab_base = (uintptr_t)0 - MM_SLAB_REGION_SIZE;
+pthread_mutex_t mm_slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// mm_slab_lock guards the pool of empty runs and the used part of the region
+static slab_t* mm_slab_pool = NULL;
+static size_t mm_slab_top = 0;
+static _Bool mm_slab_mapped = 0;
+
+// Trimmed runs lose their pool link with their pages, so a bitmap remembers them
+static uint64_t mm_slab_trimmed[MM_SLAB_REGION_SIZE / MM_SLAB_RUN_SIZE / 64];
+static size_t mm_slab_trimmed_count = 0;
+
+// Reserves the whole region, pages are only committed once a run touches them
+static _Bool mm_slab_map(void) {
+	MM_COUNT(mmap_calls, 1);
+	void* map = mmap(NULL, MM_SLAB_REGION_SIZE, PROT_WRITE | PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+	                 -1, 0);
+
+	if (map == (void*)-1) {
+#ifdef MM_DEBUG
+		perror("mmap");
+#endif
+		return 0;
+	}
+
+	__atomic_store_n(&mm_slab_base, (uintptr_t)map, __ATOMIC_RELEASE);
+	mm_slab_mapped = 1;
+
+	return 1;
+}
+
+// Takes an empty run from the pool, or from the unused part of the region
+// fresh tells whether the run's pages are still zero
+static slab_t* mm_slab_take(_Bool* fresh) {
+	slab_t* s = NULL;
+	*fresh = 1;
+
+	pthread_mutex_lock(&mm_slab_lock);
+	if (mm_slab_mapped || mm_slab_map()) {
+		if (mm_slab_pool) {
+			s = mm_slab_pool;
+			mm_slab_pool = s->next;
+			*fresh = 0;
+		} else if (mm_slab_trimmed_count) {
+			size_t w = 0;
+			while (!mm_slab_trimmed[w])
+				w++;
+
+			size_t bit = __builtin_ctzll(mm_slab_trimmed[w]);
+			mm_slab_trimmed[w] &= ~((uint64_t)1 << bit);
+			mm_slab_trimmed_count--;
+			s = (slab_t*)(mm_slab_base + (w * 64 + bit) * MM_SLAB_RUN_SIZE);
+		} else if (mm_slab_top + MM_SLAB_RUN_SIZE <= MM_SLAB_REGION_SIZE) {
+			s = (slab_t*)(mm_slab_base + mm_slab_top);
+			mm_slab_top += MM_SLAB_RUN_SIZE;
+		}
+	}
+	pthread_mutex_unlock(&mm_slab_lock);
+
+	return s;
+}
+
+static void mm_slab_release(slab_t* s) {
+	pthread_mutex_lock(&mm_slab_lock);
+	s->next = mm_slab_pool;
+	mm_slab_pool = s;
+	pthread_mutex_unlock(&mm_slab_lock);
+}
+
+// Gives the pages of every pooled run back to the kernel
+size_t mm_slab_trim(void) {
+	size_t released = 0;
+
+	slab_t* kept = NULL;
+
+	pthread_mutex_lock(&mm_slab_lock);
+	while (mm_slab_pool) {
+		slab_t* s = mm_slab_pool;
+		mm_slab_pool = s->next;
+
+		// A run that couldn't be released keeps its contents and its pool link
+		MM_COUNT(madvise_calls, 1);
+		if (madvise(s, MM_SLAB_RUN_SIZE, MADV_DONTNEED) == -1) {
+			s->next = kept;
+			kept = s;
+			continue;
+		}
+
+		size_t i = ((uintptr_t)s - mm_slab_base) / MM_SLAB_RUN_SIZE;
+		mm_slab_trimmed[i / 64] |= (uint64_t)1 << (i % 64);
+		mm_slab_trimmed_count++;
+		released += MM_SLAB_RUN_SIZE;
+	}
+	mm_slab_pool = kept;
+	pthread_mutex_unlock(&mm_slab_lock);
+
+	return released;
+}
+
+static inline size_t mm_slab_class(size_t size) { return size / MM_ALIGNMENT - 1; }
+static inline void* mm_slab_obj(slab_t* s, size_t i) { return (uint8_t*)s + MM_SLAB_OBJS_OFFSET + i * s->size; }
+
+static void mm_slab_push(arena_t* a, slab_t* s) {
+	size_t c = mm_slab_class(s->size);
+	s->prev = NULL;
+	s->next = a->slabs[c];
+	if (s->next)
+		s->next->prev = s;
+	a->slabs[c] = s;
+}
+
+static void mm_slab_unlink(arena_t* a, slab_t* s) {
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		a->slabs[mm_slab_class(s->size)] = s->next;
+
+	if (s->next)
+		s->next->prev = s->prev;
+
+	s->next = NULL;
+	s->prev = NULL;
+}
+
+static slab_t* mm_slab_new(arena_t* a, size_t size) {
+	_Bool fresh;
+	slab_t* s = mm_slab_take(&fresh);
+	if (!s)
+		return NULL;
+
+	s->arena = a;
+	s->size = (uint16_t)size;
+	s->count = (uint16_t)((MM_SLAB_RUN_SIZE - MM_SLAB_OBJS_OFFSET) / size);
+	s->used = 0;
+	s->untouched = fresh ? 0 : s->count;
+
+	a->slab_runs++;
+
+	memset(s->free_map, 0, sizeof(s->free_map));
+	for (size_t i = 0; i < s->count; i++)
+		s->free_map[i / 64] |= (uint64_t)1 << (i % 64);
+
+	mm_slab_push(a, s);
+	return s;
+}
+
+// size must be MM_ALIGNMENT-aligned and at most MM_SLAB_MAX_SIZE
+// zeroed, if not NULL, tells whether the object is known to be all zero
+void* mm_slab_alloc(arena_t* a, size_t size, _Bool* zeroed) {
+	slab_t* s = a->slabs[mm_slab_class(size)];
+
+	if (!s) {
+		s = mm_slab_new(a, size);
+		if (!s)
+			return NULL;
+	}
+
+	// Runs on the list always have a free object
+	size_t w = 0;
+	while (!s->free_map[w])
+		w++;
+
+	size_t bit = __builtin_ctzll(s->free_map[w]);
+	size_t i = w * 64 + bit;
+	s->free_map[w] &= ~((uint64_t)1 << bit);
+	s->used++;
+	a->slab_used += s->size;
+
+	if (zeroed)
+		*zeroed = MM_KNOWN_ZERO(i >= s->untouched);
+	if (i >= s->untouched)
+		s->untouched = (uint16_t)(i + 1);
+
+	if (s->used == s->count)
+		mm_slab_unlink(a, s);
+
+	return mm_slab_obj(s, i);
+}
+
+// Expects the lock of the run's arena to be held
+void mm_slab_free(slab_t* s, void* p) {
+	arena_t* a = s->arena;
+	size_t i = (size_t)((uint8_t*)p - (uint8_t*)mm_slab_obj(s, 0)) / s->size;
+	uint64_t bit = (uint64_t)1 << (i % 64);
+
+#ifdef MM_DEBUG
+	if (p != mm_slab_obj(s, i)) {
+		fprintf(stderr, "Ptr is not the start of a slab object\n");
+		fflush(stderr);
+		MM_ABORT();
+	}
+#endif
+
+	// Double free check
+	if (s->free_map[i / 64] & bit) {
+#ifdef MM_DEBUG
+		fprintf(stderr, "Double free detected\n");
+		fflush(stderr);
+		MM_ABORT();
+#else
+		return;
+#endif
+	}
+
+	s->free_map[i / 64] |= bit;
+	a->slab_used -= s->size;
+
+	// A full run gets back on the list
+	if (s->used == s->count)
+		mm_slab_push(a, s);
+
+	s->used--;
+
+	// The last partial run of a class is kept to avoid churn
+	if (s->used == 0 && (s->prev || s->next)) {
+		mm_slab_unlink(a, s);
+		mm_slab_release(s);
+		a->slab_runs--;
+	}
+}
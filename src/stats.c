@@ -1,6 +1,9 @@
 #include "interface.h"
 
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static void format_size(char* buf, size_t bytes) {
 	const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
@@ -15,55 +18,168 @@ static void format_size(char* buf, size_t bytes) {
 	snprintf(buf, 64, "%.2f%s", s, units[u]);
 }
 
+mm_counters_t mm_counters;
+
+static inline size_t mm_load(size_t* p) { return __atomic_load_n(p, __ATOMIC_RELAXED); }
+
+// Takes each arena's lock in turn, nothing is walked
+void mm_get_stats(struct mm_stats* s) {
+	memset(s, 0, sizeof(*s));
+
+	for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+		arena_t* a = mm_arena_at(i);
+		if (!a)
+			continue;
+
+		MM_LOCK(a);
+		if (a->initialized) {
+			size_t top = MM_GET_SIZE(a->top) + MM_METADATA_SIZE;
+
+			s->heap_bytes += a->heap_size;
+			s->heap_top_bytes += top;
+			s->heap_free_bytes += top;
+			s->heap_free_blocks += a->free_blocks;
+			s->heap_fast_blocks += a->fast_blocks;
+			s->heap_fast_bytes += a->fast_bytes;
+
+			for (size_t c = 0; c < MM_FL_COUNT; c++) {
+				s->free_class_bytes[c] += a->free_bytes[c];
+				s->heap_free_bytes += a->free_bytes[c];
+			}
+		}
+		s->slab_bytes += a->slab_runs * MM_SLAB_RUN_SIZE;
+		s->slab_used_bytes += a->slab_used;
+		MM_UNLOCK(a);
+	}
+
+	s->mmap_bytes = mm_load(&mm_counters.mmap_bytes);
+	s->mmap_chunks = mm_load(&mm_counters.mmap_chunks);
+	s->in_use_bytes = s->heap_bytes - s->heap_free_bytes - s->heap_fast_bytes + s->slab_used_bytes + s->mmap_bytes;
+
+	struct mm_mmap_cache_stats cache;
+	mm_get_mmap_cache_stats(&cache);
+	s->mmap_cached_bytes = cache.cached_bytes;
+
+	s->grows = mm_load(&mm_counters.grows);
+	s->trims = mm_load(&mm_counters.trims);
+	s->mprotect_calls = mm_load(&mm_counters.mprotect_calls);
+	s->mmap_calls = mm_load(&mm_counters.mmap_calls);
+	s->munmap_calls = mm_load(&mm_counters.munmap_calls);
+	s->mremap_calls = mm_load(&mm_counters.mremap_calls);
+	s->madvise_calls = mm_load(&mm_counters.madvise_calls);
+	s->heap_segments = mm_load(&mm_counters.segments);
+	s->deferred_frees = mm_load(&mm_counters.deferred_frees);
+	s->thp_bytes = mm_load(&mm_counters.thp_bytes);
+}
+
+// Reads the file with plain syscalls, stdio would allocate
+size_t mm_thp_backed_bytes(void) {
+	static const char key[] = "AnonHugePages:";
+	char buf[4096];
+
+	int fd = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return 0;
+
+	ssize_t n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+
+	char* p = strstr(buf, key);
+	if (!p)
+		return 0;
+
+	return (size_t)strtoull(p + sizeof(key) - 1, NULL, 10) * 1024;
+}
+
+// Heap and slab bytes make up arena, the top chunks are the trimmable part
+struct mm_mallinfo2 mm_mallinfo2(void) {
+	struct mm_stats s;
+	struct mm_mallinfo2 mi = {0};
+
+	mm_get_stats(&s);
+
+	mi.arena = s.heap_bytes + s.slab_bytes;
+	mi.ordblks = s.heap_free_blocks;
+	mi.smblks = s.heap_fast_blocks;
+	mi.hblks = s.mmap_chunks;
+	mi.hblkhd = s.mmap_bytes;
+	mi.fsmblks = s.heap_fast_bytes;
+	mi.fordblks = s.heap_free_bytes + s.heap_fast_bytes + (s.slab_bytes - s.slab_used_bytes);
+	mi.uordblks = mi.arena - mi.fordblks;
+	mi.keepcost = s.heap_top_bytes;
+
+	return mi;
+}
+
+struct mm_mallinfo2 mallinfo2(void) __attribute__((alias("mm_mallinfo2")));
+
 #ifdef MM_DEBUG
 size_t heap_bytes, mmap_bytes, heap_allocs, mmap_allocs;
+// Counters are bumped outside the arena locks on the thread cache path
 inline void mm_add_alloced(size_t n, _Bool mmap) {
 	if (mmap) {
-		mmap_bytes += n;
-		mmap_allocs++;
+		__atomic_fetch_add(&mmap_bytes, n, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&mmap_allocs, 1, __ATOMIC_RELAXED);
 	} else {
-		heap_bytes += n;
-		heap_allocs++;
+		__atomic_fetch_add(&heap_bytes, n, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&heap_allocs, 1, __ATOMIC_RELAXED);
 	}
 }
 
-void mm_print_alloced(void) {
+static void print_arena_alloced(arena_t* a) {
 	char buf[64];
-	header_t* h = mm_heap_start;
+	header_t* h = a->heap_start;
 	header_t* f;
 	size_t s;
 
-	printf("Heap:\n");
-	while ((void*)h < mm_heap_end) {
+	while ((void*)h != a->heap_end) {
 		if (MM_IS_FREE(h)) {
-			h = MM_NEXT_HEADER(h);
+			h = MM_WALK_NEXT(a, h);
 			continue;
 		}
 
 		s = MM_GET_SIZE(h);
-		f = h->prev;
+		f = MM_IS_PREV_FREE(h) ? MM_PREV_HEADER(h) : NULL;
 
-		if (h != f->prev) {
-			fprintf(stderr, "header->prev MISMATCH at %p\n", (void*)h);
+		if (f && MM_NEXT_HEADER(f) != h) {
+			fprintf(stderr, "header->prev_foot MISMATCH at %p\n", (void*)h);
 			MM_ABORT();
 		}
 
 		format_size(buf, s);
 		printf("%s | %p | size=%s\n", MM_IS_FREE(h) ? "FREE" : "USED", (void*)h, buf);
 
-		h = MM_NEXT_HEADER(h);
+		h = MM_WALK_NEXT(a, h);
 	}
 }
 
-void mm_print_free(void) {
+void mm_print_alloced(void) {
+	for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+		arena_t* a = mm_arena_at(i);
+		if (!a || !a->initialized)
+			continue;
+
+		printf("Arena %zu heap:\n", i);
+		MM_LOCK(a);
+		print_arena_alloced(a);
+		MM_UNLOCK(a);
+	}
+}
+
+static void print_arena_free(arena_t* a) {
 	header_t* prev = NULL;
 	int steps = 0;
 	char buf[64];
 
 	for (size_t i = 0; i < MM_BIN_COUNT; i++) {
-		header_t* cur = mm_free_lists[i];
+		header_t* cur = a->free_lists[i];
+		if (!cur)
+			continue;
 
-		printf("Free List %zu:\n", i);
+		printf("Free List %zu (from %zu bytes):\n", i, mm_size_from_idx(i));
 		while (cur) {
 			steps++;
 			format_size(buf, MM_GET_SIZE(cur));
@@ -79,6 +195,19 @@ void mm_print_free(void) {
 	}
 }
 
+void mm_print_free(void) {
+	for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+		arena_t* a = mm_arena_at(i);
+		if (!a || !a->initialized)
+			continue;
+
+		printf("Arena %zu:\n", i);
+		MM_LOCK(a);
+		print_arena_free(a);
+		MM_UNLOCK(a);
+	}
+}
+
 void mm_print_stats(void) {
 	printf("Stats:\n\n");
 	char buf[64];
@@ -86,14 +215,41 @@ void mm_print_stats(void) {
 	size_t tot_bytes = heap_bytes + mmap_bytes;
 	size_t tot_allocs = heap_allocs + mmap_allocs;
 
-	format_size(buf, mm_heap_size);
-	printf("Heap size is %s\n", buf);
+	size_t heap_size = 0;
+	size_t arenas = 0;
+	for (size_t i = 0; i < MM_ARENA_COUNT; i++) {
+		arena_t* a = mm_arena_at(i);
+		if (a && a->initialized) {
+			heap_size += a->heap_size;
+			arenas++;
+		}
+	}
+
+	format_size(buf, heap_size);
+	printf("Heap size is %s over %zu arenas\n", buf, arenas);
 	format_size(buf, tot_bytes);
 	printf("%zu blocks were allocated %s\n", tot_allocs, buf);
 	format_size(buf, heap_bytes);
 	printf("%zu in the heap %s\n", heap_allocs, buf);
 	format_size(buf, mmap_bytes);
 	printf("%zu with mmap %s\n", mmap_allocs, buf);
+
+	struct mm_mmap_cache_stats cache;
+	mm_get_mmap_cache_stats(&cache);
+	format_size(buf, cache.cached_bytes);
+	printf("mmap cache: %zu hits, %zu misses, %zu evictions, %zu chunks cached %s\n", cache.hits, cache.misses,
+	       cache.evictions, cache.cached_chunks, buf);
+
+	struct mm_stats st;
+	mm_get_stats(&st);
+	size_t syscalls = st.mprotect_calls + st.mmap_calls + st.munmap_calls + st.mremap_calls + st.madvise_calls;
+	format_size(buf, st.in_use_bytes);
+	printf("%s in use, %zu grows, %zu trims, %zu syscalls\n", buf, st.grows, st.trims, syscalls);
+
+	char backed[64];
+	format_size(buf, st.thp_bytes);
+	format_size(backed, mm_thp_backed_bytes());
+	printf("%s advised for huge pages, %s backed by them\n", buf, backed);
 }
 #else
 inline void mm_add_alloced(size_t n, _Bool mmap) {}
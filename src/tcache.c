@@ -0,0 +1,94 @@
+#include "interface.h"
+
+#include <stdio.h>
+
+/*
+ * Per-thread cache of freed payloads
+ *
+ * bins[i] holds payloads of exactly (i + 1) * MM_ALIGNMENT bytes
+ * The cache is flushed back to the heap when the thread exits,
+ * after which the thread bypasses it
+ */
+typedef struct tcache {
+	void* bins[MM_TCACHE_BINS];
+	uint16_t counts[MM_TCACHE_BINS];
+	_Bool registered;
+	_Bool disabled;
+} tcache_t;
+
+static MM_TLS tcache_t mm_tcache;
+static pthread_key_t mm_tcache_key;
+static pthread_once_t mm_tcache_once = PTHREAD_ONCE_INIT;
+
+static void mm_tcache_destroy(void* arg) {
+	(void)arg;
+	mm_tcache_flush();
+	mm_tcache.disabled = 1;
+}
+
+static void mm_tcache_key_init(void) { pthread_key_create(&mm_tcache_key, mm_tcache_destroy); }
+
+static inline size_t mm_tcache_idx(size_t size) { return size / MM_ALIGNMENT - 1; }
+
+void* mm_tcache_get(size_t size) {
+	if (size > MM_TCACHE_MAX_SIZE)
+		return NULL;
+
+	size_t i = mm_tcache_idx(size);
+	void* p = mm_tcache.bins[i];
+	if (!p)
+		return NULL;
+
+	mm_tcache.bins[i] = *(void**)p;
+	mm_tcache.counts[i]--;
+
+	return p;
+}
+
+_Bool mm_tcache_put(void* p, size_t size) {
+	if (size > MM_TCACHE_MAX_SIZE || mm_tcache.disabled)
+		return 0;
+
+	size_t i = mm_tcache_idx(size);
+	if (mm_tcache.counts[i] >= MM_TCACHE_COUNT)
+		return 0;
+
+	// The destructor only runs for keys with a non-NULL value
+	if (!mm_tcache.registered) {
+		pthread_once(&mm_tcache_once, mm_tcache_key_init);
+		pthread_setspecific(mm_tcache_key, &mm_tcache);
+		mm_tcache.registered = 1;
+	}
+
+#ifdef MM_DEBUG
+	for (void* cur = mm_tcache.bins[i]; cur; cur = *(void**)cur) {
+		if (cur == p) {
+			fprintf(stderr, "Double free detected\n");
+			fflush(stderr);
+			MM_ABORT();
+		}
+	}
+#endif
+
+	*(void**)p = mm_tcache.bins[i];
+	mm_tcache.bins[i] = p;
+	mm_tcache.counts[i]++;
+
+	return 1;
+}
+
+// Returns every cached block to the shared heap
+// Blocks may come from any arena, each one is returned under its own arena's lock
+void mm_tcache_flush(void) {
+	for (size_t i = 0; i < MM_TCACHE_BINS; i++) {
+		void* p = mm_tcache.bins[i];
+		while (p) {
+			void* next = *(void**)p;
+			mm_free_shared(p);
+			p = next;
+		}
+
+		mm_tcache.bins[i] = NULL;
+		mm_tcache.counts[i] = 0;
+	}
+}
@@ -1,11 +1,15 @@
 #include "../mem.h"
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define OPS 100000
+#define THREADS 4
+#define MIB_256 ((size_t)256 * 1024 * 1024)
 
 void fragmentation_test(void);
 void integrity_test(void);
@@ -14,8 +18,35 @@ void rand_test(void);
 void mmap_test(void);
 void shrink(void);
 void grow(void);
+void threads(void);
+void arena_exhaustion(void);
+void slab_test(void);
+void trim_test(void);
+void mmap_cache_test(void);
+void mmap_realloc(void);
+void calloc_test(void);
+void aligned_test(void);
+void sized_test(void);
+void fit_test(void);
+void options_test(void);
+void growth_test(void);
+void stats_test(void);
+void analyze_test(void);
+void thp_test(void);
+void segment_test(void);
+void batch_test(void);
+void boundary_tag_test(void);
+void fast_bin_test(void);
+void deferred_test(void);
+void profile_test(void);
+void latency_test(void);
 
 int main(void) {
+	// Fixing the threshold turns the dynamic one off, other tests rely on it
+	assert(mm_mallopt(MM_OPT_MMAP_THRESHOLD, 128 * 1024));
+	// Small main heap segments, so the tests run across several of them
+	assert(mm_mallopt(MM_OPT_HEAP_RESERVE, 32 * 1024 * 1024));
+
 	fragmentation_test();
 	integrity_test();
 	exhaustion();
@@ -23,6 +54,28 @@ int main(void) {
 	mmap_test();
 	shrink();
 	grow();
+	threads();
+	arena_exhaustion();
+	slab_test();
+	trim_test();
+	mmap_cache_test();
+	mmap_realloc();
+	calloc_test();
+	aligned_test();
+	sized_test();
+	fit_test();
+	options_test();
+	growth_test();
+	stats_test();
+	analyze_test();
+	thp_test();
+	segment_test();
+	batch_test();
+	boundary_tag_test();
+	fast_bin_test();
+	deferred_test();
+	profile_test();
+	latency_test();
 
 	mm_print_stats();
 
@@ -137,3 +190,954 @@ void grow(void) {
 
 	free(p);
 }
+
+static void* thread_worker(void* arg) {
+	uint8_t tag = (uint8_t)(uintptr_t)arg;
+	void* slots[64] = {0};
+
+	for (int i = 0; i < OPS; i++) {
+		int idx = i % 64;
+		size_t sz = ((i * 7) % 512) + 1;
+
+		free(slots[idx]);
+		slots[idx] = malloc(sz);
+		assert(slots[idx]);
+		memset(slots[idx], tag, sz);
+		assert(((uint8_t*)slots[idx])[sz - 1] == tag);
+	}
+
+	for (int i = 1; i < 64; i++)
+		free(slots[i]);
+
+	// The first slot is freed by the main thread
+	return slots[0];
+}
+
+void threads(void) {
+	pthread_t tids[THREADS];
+	for (int i = 0; i < THREADS; i++)
+		assert(pthread_create(&tids[i], NULL, thread_worker, (void*)(uintptr_t)(i + 1)) == 0);
+
+	for (int i = 0; i < THREADS; i++) {
+		void* leftover;
+		assert(pthread_join(tids[i], &leftover) == 0);
+		free(leftover);
+	}
+}
+
+// Fills more than a whole arena region so the main arena has to take over
+static void* exhaustion_worker(void* arg) {
+	(void)arg;
+	const size_t sz = 100 * 1024;
+	void* slots[1024];
+
+	for (int i = 0; i < 1024; i++) {
+		slots[i] = malloc(sz);
+		assert(slots[i]);
+		memset(slots[i], 0x11, sz);
+	}
+
+	for (int i = 0; i < 1024; i++)
+		free(slots[i]);
+
+	return NULL;
+}
+
+void arena_exhaustion(void) {
+	pthread_t tid;
+	assert(pthread_create(&tid, NULL, exhaustion_worker, NULL) == 0);
+	assert(pthread_join(tid, NULL) == 0);
+}
+
+void slab_test(void) {
+	static uint8_t* objs[4096];
+
+	for (int i = 0; i < 4096; i++) {
+		size_t sz = (i % 256) + 1;
+		objs[i] = malloc(sz);
+		assert(objs[i]);
+		assert((uintptr_t)objs[i] % _Alignof(max_align_t) == 0);
+		memset(objs[i], (uint8_t)i, sz);
+	}
+
+	// Free every other object so runs become partial, then refill them
+	for (int i = 0; i < 4096; i += 2)
+		free(objs[i]);
+	for (int i = 0; i < 4096; i += 2) {
+		objs[i] = malloc((i % 256) + 1);
+		memset(objs[i], (uint8_t)i, (i % 256) + 1);
+	}
+
+	for (int i = 0; i < 4096; i++) {
+		size_t sz = (i % 256) + 1;
+		assert(objs[i][0] == (uint8_t)i && objs[i][sz - 1] == (uint8_t)i);
+	}
+
+	// Growing past the size class moves the object out of its run
+	uint8_t* p = realloc(objs[0], 1000);
+	assert(p);
+	assert(p[0] == 0);
+	objs[0] = p;
+
+	for (int i = 0; i < 4096; i++)
+		free(objs[i]);
+}
+
+void trim_test(void) {
+	const size_t sz = 64 * 1024;
+	uint8_t* blocks[32];
+
+	for (int i = 0; i < 32; i++) {
+		blocks[i] = malloc(sz);
+		assert(blocks[i]);
+		memset(blocks[i], i, sz);
+	}
+
+	// Holes between live blocks can only be decommitted, not released
+	for (int i = 0; i < 32; i += 2)
+		free(blocks[i]);
+
+	assert(mm_trim(0) == 1);
+
+	for (int i = 1; i < 32; i += 2)
+		assert(blocks[i][0] == i && blocks[i][sz - 1] == i);
+
+	for (int i = 0; i < 32; i += 2) {
+		blocks[i] = malloc(sz);
+		assert(blocks[i]);
+		memset(blocks[i], i, sz);
+	}
+
+	for (int i = 0; i < 32; i++)
+		free(blocks[i]);
+
+	mm_trim(0);
+}
+
+void mmap_cache_test(void) {
+	const size_t mib = 1024 * 1024;
+	struct mm_mmap_cache_stats before, after;
+	mm_get_mmap_cache_stats(&before);
+
+	uint8_t* p = malloc(mib);
+	assert(p);
+	memset(p, 0x42, mib);
+	free(p);
+
+	// The same size comes back from the cache
+	uint8_t* q = malloc(mib);
+	assert(q);
+	memset(q, 0x24, mib);
+
+	mm_get_mmap_cache_stats(&after);
+	assert(after.hits == before.hits + 1);
+	free(q);
+
+	// Too big to be cached
+	p = malloc(MIB_256);
+	assert(p);
+	free(p);
+	mm_get_mmap_cache_stats(&before);
+	p = malloc(MIB_256);
+	assert(p);
+	mm_get_mmap_cache_stats(&after);
+	assert(after.hits == before.hits);
+	free(p);
+}
+
+void mmap_realloc(void) {
+	// A heap block growing past the threshold gets promoted to a mapping
+	uint8_t* p = malloc(1000);
+	assert(p);
+	memset(p, 0x3C, 1000);
+
+	size_t sizes[] = {300 * 1024, 4 * 1024 * 1024, 64 * 1024 * 1024, 200 * 1024, 130 * 1024};
+	size_t valid = 1000;
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		p = realloc(p, sizes[i]);
+		assert(p);
+
+		for (size_t j = 0; j < valid && j < sizes[i]; j += 997)
+			assert(p[j] == 0x3C);
+
+		memset(p, 0x3C, sizes[i]);
+		valid = sizes[i];
+	}
+
+	free(p);
+}
+
+static void assert_zero(const uint8_t* p, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		assert(p[i] == 0);
+}
+
+// Dirty blocks of every kind are freed first, so calloc has to reuse them
+void calloc_test(void) {
+	size_t sizes[] = {24, 200, 900, 5000, 60 * 1024, 1024 * 1024};
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (int round = 0; round < 4; round++) {
+			uint8_t* dirty = malloc(sizes[i]);
+			assert(dirty);
+			memset(dirty, 0xFF, sizes[i]);
+			free(dirty);
+
+			uint8_t* p = calloc(sizes[i], 1);
+			assert(p);
+			assert_zero(p, sizes[i]);
+			memset(p, 0xFF, sizes[i]);
+			free(p);
+		}
+	}
+
+	// Fresh memory past anything handed out so far
+	uint8_t* blocks[64];
+	for (int i = 0; i < 64; i++) {
+		blocks[i] = calloc(1000 + i * 16, 1);
+		assert(blocks[i]);
+		assert_zero(blocks[i], 1000 + i * 16);
+		memset(blocks[i], 0xFF, 1000 + i * 16);
+	}
+	for (int i = 0; i < 64; i++)
+		free(blocks[i]);
+}
+
+// Every alignment from the heap up to mmap, with a neighbour to keep blocks apart
+void aligned_test(void) {
+	size_t aligns[] = {32, 64, 256, 4096, 64 * 1024, 2 * 1024 * 1024};
+	size_t sizes[] = {1, 100, 3000, 70 * 1024, 300 * 1024};
+
+	for (size_t i = 0; i < sizeof(aligns) / sizeof(aligns[0]); i++) {
+		for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			uint8_t* p;
+			assert(posix_memalign((void**)&p, aligns[i], sizes[j]) == 0);
+			assert((uintptr_t)p % aligns[i] == 0);
+			memset(p, 0x6B, sizes[j]);
+
+			uint8_t* q = malloc(sizes[j]);
+			assert(q);
+
+			p = realloc(p, sizes[j] * 2);
+			assert(p);
+			for (size_t k = 0; k < sizes[j]; k += 97)
+				assert(p[k] == 0x6B);
+
+			free(q);
+			free(p);
+		}
+	}
+
+	uint8_t* blocks[256];
+	for (int i = 0; i < 256; i++) {
+		size_t align = (size_t)32 << (i % 8);
+		blocks[i] = aligned_alloc(align, (i % 16) * 40 + 1);
+		assert(blocks[i]);
+		assert((uintptr_t)blocks[i] % align == 0);
+		memset(blocks[i], i, (i % 16) * 40 + 1);
+	}
+	for (int i = 0; i < 256; i += 2)
+		free(blocks[i]);
+	for (int i = 1; i < 256; i += 2) {
+		assert(blocks[i][0] == (uint8_t)i);
+		free(blocks[i]);
+	}
+
+	void* p;
+	assert(posix_memalign(&p, 24, 100) != 0);
+	assert(posix_memalign(&p, 2, 100) != 0);
+	assert(!aligned_alloc(48, 100));
+
+	p = memalign(48, 100);
+	assert(p && (uintptr_t)p % 64 == 0);
+	free(p);
+
+	p = valloc(10);
+	assert(p && (uintptr_t)p % 4096 == 0);
+	free(p);
+}
+
+// The whole usable size can be written, and sized frees take every kind of block
+void sized_test(void) {
+	size_t sizes[] = {1, 24, 250, 1000, 5000, 100 * 1024, 1024 * 1024};
+
+	assert(malloc_usable_size(NULL) == 0);
+
+	for (int round = 0; round < 64; round++) {
+		for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			uint8_t* p = malloc(sizes[i]);
+			assert(p);
+
+			size_t usable = malloc_usable_size(p);
+			assert(usable >= sizes[i]);
+			memset(p, 0x5E, usable);
+
+			if (round % 2)
+				free_sized(p, sizes[i]);
+			else
+				free(p);
+		}
+	}
+
+	// Shrinking in place keeps the usable size consistent with the new size
+	uint8_t* p = malloc(200);
+	p = realloc(p, 40);
+	assert(p && malloc_usable_size(p) >= 40);
+	free_sized(p, 40);
+
+	p = aligned_alloc(256, 3000);
+	assert(p && malloc_usable_size(p) >= 3000);
+	memset(p, 0x5E, malloc_usable_size(p));
+	free_aligned_sized(p, 256, 3000);
+}
+
+// Frees blocks of scattered sizes in random order, so every list level gets used
+void fit_test(void) {
+	static uint8_t* slots[512];
+	static size_t sizes[512];
+
+	for (int i = 0; i < OPS; i++) {
+		int idx = rand() % 512;
+
+		if (slots[idx]) {
+			assert(slots[idx][0] == (uint8_t)idx && slots[idx][sizes[idx] - 1] == (uint8_t)idx);
+			free(slots[idx]);
+			slots[idx] = NULL;
+			continue;
+		}
+
+		sizes[idx] = 257 + (size_t)rand() % (rand() % 2 ? 2000 : 100000);
+		slots[idx] = malloc(sizes[idx]);
+		assert(slots[idx]);
+		slots[idx][0] = (uint8_t)idx;
+		slots[idx][sizes[idx] - 1] = (uint8_t)idx;
+	}
+
+	for (int i = 0; i < 512; i++)
+		free(slots[i]);
+}
+
+static size_t cache_lookups(void) {
+	struct mm_mmap_cache_stats s;
+	mm_get_mmap_cache_stats(&s);
+	return s.hits + s.misses;
+}
+
+void options_test(void) {
+	const size_t sz = 200 * 1024;
+
+	assert(!mm_mallopt(-1, 0));
+	assert(!mm_mallopt(MM_OPT_MMAP_THRESHOLD, 0));
+	assert(!mm_mallopt(MM_OPT_GROWTH_FACTOR, 1));
+
+	// Past the threshold blocks come from the heap
+	assert(mm_mallopt(MM_OPT_MMAP_THRESHOLD, 1024 * 1024));
+	size_t before = cache_lookups();
+	uint8_t* p = malloc(sz);
+	assert(p);
+	memset(p, 0x77, sz);
+	assert(cache_lookups() == before);
+	free(p);
+
+	// Freeing a short-lived mapping raises the threshold past its size
+	assert(mm_mallopt(MM_OPT_MMAP_THRESHOLD, 128 * 1024));
+	assert(mm_mallopt(MM_OPT_DYNAMIC_MMAP, 1));
+	before = cache_lookups();
+	p = malloc(sz);
+	assert(p);
+	assert(cache_lookups() == before + 1);
+	free(p);
+
+	for (int i = 0; i < 16; i++) {
+		p = malloc(sz);
+		assert(p);
+		memset(p, 0x77, sz);
+		free(p);
+	}
+	assert(cache_lookups() == before + 1);
+
+	// Disabling the cache unmaps chunks right away
+	struct mm_mmap_cache_stats s1, s2;
+	assert(mm_mallopt(MM_OPT_MMAP_CACHE_MAX_CHUNKS, 0));
+	p = malloc(MIB_256 / 8);
+	assert(p);
+	mm_get_mmap_cache_stats(&s1);
+	free(p);
+	mm_get_mmap_cache_stats(&s2);
+	assert(s2.cached_chunks <= s1.cached_chunks);
+	assert(mm_mallopt(MM_OPT_MMAP_CACHE_MAX_CHUNKS, 16));
+
+	assert(mm_mallopt(MM_OPT_MMAP_THRESHOLD, 128 * 1024));
+	assert(mm_mallopt(MM_OPT_TRIM_THRESHOLD, 128 * 1024));
+}
+
+// A request bigger than the heap grows it in one step, in a fresh arena and in the main one
+static void* growth_worker(void* arg) {
+	size_t sz = (size_t)(uintptr_t)arg;
+	uint8_t* small = malloc(300);
+	uint8_t* big = malloc(sz);
+	assert(small && big);
+
+	memset(big, 0x19, sz);
+	memset(small, 0x91, 300);
+	assert(big[0] == 0x19 && big[sz - 1] == 0x19);
+
+	free(big);
+	free(small);
+	return NULL;
+}
+
+void growth_test(void) {
+	const size_t sz = 20 * 1024 * 1024;
+	assert(mm_mallopt(MM_OPT_MMAP_THRESHOLD, 32 * 1024 * 1024));
+
+	pthread_t tid;
+	assert(pthread_create(&tid, NULL, growth_worker, (void*)(uintptr_t)sz) == 0);
+	assert(pthread_join(tid, NULL) == 0);
+	growth_worker((void*)(uintptr_t)sz);
+
+	// Linear growth past the maximum step
+	assert(mm_mallopt(MM_OPT_GROWTH_MAX_STEP, 64 * 1024));
+	uint8_t* blocks[256];
+	for (int i = 0; i < 256; i++) {
+		blocks[i] = malloc(30000);
+		assert(blocks[i]);
+		memset(blocks[i], i, 30000);
+	}
+	for (int i = 0; i < 256; i++) {
+		assert(blocks[i][29999] == (uint8_t)i);
+		free(blocks[i]);
+	}
+
+	assert(mm_mallopt(MM_OPT_GROWTH_MAX_STEP, 32 * 1024 * 1024));
+	assert(mm_mallopt(MM_OPT_MMAP_THRESHOLD, 128 * 1024));
+}
+
+void stats_test(void) {
+	const size_t heap_sz = 64 * 1024;
+	const size_t mmap_sz = 1024 * 1024;
+	struct mm_stats before, during, after;
+
+	mm_get_stats(&before);
+
+	void* h = malloc(heap_sz);
+	void* m = malloc(mmap_sz);
+	void* s = malloc(100);
+	assert(h && m && s);
+
+	mm_get_stats(&during);
+	// The small block may come from the thread cache, which already counts as in use
+	assert(during.in_use_bytes >= before.in_use_bytes + heap_sz + mmap_sz);
+	assert(during.mmap_chunks == before.mmap_chunks + 1);
+	assert(during.mmap_bytes >= before.mmap_bytes + mmap_sz);
+	assert(during.slab_used_bytes >= 100 && during.slab_used_bytes <= during.slab_bytes);
+	assert(during.heap_free_bytes <= during.heap_bytes);
+
+	size_t free_classes = 0;
+	for (int i = 0; i < MM_STATS_FREE_CLASSES; i++)
+		free_classes += during.free_class_bytes[i];
+	assert(free_classes + during.heap_top_bytes == during.heap_free_bytes);
+
+	struct mm_mallinfo2 mi = mm_mallinfo2();
+	assert(mi.uordblks + mi.fordblks == mi.arena);
+	assert(mi.hblks == during.mmap_chunks);
+
+	free(h);
+	free(m);
+	free(s);
+
+	mm_get_stats(&after);
+	assert(after.mmap_chunks == before.mmap_chunks);
+	assert(after.mmap_bytes == before.mmap_bytes);
+	assert(after.mmap_calls + after.munmap_calls + after.mprotect_calls > 0);
+}
+
+static size_t json_field(const char* json, const char* key) {
+	const char* p = strstr(json, key);
+	assert(p);
+
+	size_t v;
+	assert(sscanf(p + strlen(key), "\":%zu", &v) == 1);
+	return v;
+}
+
+void analyze_test(void) {
+	enum { N = 64 };
+	void* blocks[N];
+	static char buf[64 * 1024];
+
+	// Every other block is freed, so none of them can coalesce
+	for (int i = 0; i < N; i++) {
+		blocks[i] = malloc(2048);
+		assert(blocks[i]);
+	}
+	for (int i = 0; i < N; i += 2)
+		free(blocks[i]);
+
+	// Enough tiny requests to publish this thread's tally
+	assert(mm_mallopt(MM_OPT_WASTE, 1));
+	void* tiny[128];
+	for (size_t i = 0; i < sizeof(tiny) / sizeof(tiny[0]); i++)
+		tiny[i] = malloc(1);
+
+	size_t len = mm_heap_analyze(buf, sizeof(buf));
+	assert(len > 0 && len < sizeof(buf) && strlen(buf) == len);
+	assert(buf[0] == '{' && buf[len - 1] == '}');
+
+	assert(strstr(buf, "\"min_size\":2048,"));
+	assert(json_field(buf, "\"free_blocks") >= N / 2);
+	assert(json_field(buf, "\"largest_free") >= 2048);
+	assert(json_field(buf, "\"header_bytes") > 0);
+	assert(json_field(buf, "\"usable_bytes") > json_field(buf, "\"requested_bytes"));
+	assert(strstr(buf, "\"tracked\":true"));
+	assert(mm_mallopt(MM_OPT_WASTE, 0));
+
+	// A short buffer is cut, but still terminated
+	char small[16];
+	assert(mm_heap_analyze(small, sizeof(small)) >= sizeof(small));
+	assert(strlen(small) == sizeof(small) - 1);
+
+	for (int i = 1; i < N; i += 2)
+		free(blocks[i]);
+	for (size_t i = 0; i < sizeof(tiny) / sizeof(tiny[0]); i++)
+		free(tiny[i]);
+}
+
+void thp_test(void) {
+	const size_t huge = 2 * 1024 * 1024;
+	// Exactly 8 huge pages with the header, so the rounding is free
+	const size_t size = 8 * huge - 64;
+	struct mm_stats before, during, after;
+
+	assert(mm_mallopt(MM_OPT_THP, 1));
+	mm_get_stats(&before);
+
+	char* p = malloc(size);
+	assert(p);
+	assert((uintptr_t)p % huge < 4096);
+	memset(p, 1, size);
+
+	mm_get_stats(&during);
+	assert(during.thp_bytes == before.thp_bytes + 8 * huge);
+
+	// Growing keeps whole huge pages
+	p = realloc(p, size + huge);
+	assert(p && p[size - 1] == 1);
+	mm_get_stats(&during);
+	assert(during.thp_bytes == before.thp_bytes + 9 * huge);
+
+	free(p);
+	mm_get_stats(&after);
+	assert(after.thp_bytes == before.thp_bytes);
+
+	// Heap growth is advised too, and trimming gives it back in whole huge pages
+	static void* blocks[1024];
+	size_t n = 0;
+	while (n < 1024) {
+		blocks[n++] = malloc(64 * 1024);
+		mm_get_stats(&during);
+		if (during.thp_bytes > before.thp_bytes)
+			break;
+	}
+	assert(during.thp_bytes > before.thp_bytes);
+	assert((during.thp_bytes - before.thp_bytes) % huge == 0);
+
+	while (n)
+		free(blocks[--n]);
+	mm_trim(0);
+
+	mm_get_stats(&after);
+	assert(after.thp_bytes < during.thp_bytes);
+	(void)mm_thp_backed_bytes();
+
+	assert(mm_mallopt(MM_OPT_THP, 0));
+}
+
+void segment_test(void) {
+	enum { N = 2048 };
+	const size_t sz = 64 * 1024;
+	static uint8_t* blocks[N];
+	struct mm_stats before, during, after;
+
+	mm_get_stats(&before);
+
+	size_t n = 0;
+	while (n < N) {
+		blocks[n] = malloc(sz);
+		assert(blocks[n]);
+		memset(blocks[n], (int)n, sz);
+		n++;
+
+		mm_get_stats(&during);
+		if (during.heap_segments > before.heap_segments)
+			break;
+	}
+	assert(during.heap_segments == before.heap_segments + 1);
+
+	// Blocks on both sides of the fence keep their contents
+	for (size_t i = 0; i < n; i++)
+		assert(blocks[i][0] == (uint8_t)i && blocks[i][sz - 1] == (uint8_t)i);
+
+	// Every other block first, so the rest coalesce with both neighbours
+	for (size_t i = 0; i < n; i += 2)
+		free(blocks[i]);
+	for (size_t i = 1; i < n; i += 2)
+		free(blocks[i]);
+
+	// The old segment's blocks merged back, so it takes them all again
+	for (size_t i = 0; i < n; i++) {
+		blocks[i] = malloc(sz);
+		assert(blocks[i]);
+	}
+	mm_get_stats(&after);
+	assert(after.heap_segments == during.heap_segments);
+
+	for (size_t i = 0; i < n; i++)
+		free(blocks[i]);
+	mm_trim(0);
+}
+
+void batch_test(void) {
+	enum { N = 64 };
+	const size_t sizes[] = {48, 512, 256 * 1024};
+	void* ptrs[3 * N + 1];
+	struct mm_stats before, after;
+
+	// Batches bypass the thread cache, so the free block count is exact
+	mm_get_stats(&before);
+
+	for (int k = 0; k < 3; k++) {
+		void** out = ptrs + k * N;
+		assert(mm_malloc_batch(sizes[k], N, out) == N);
+
+		for (int i = 0; i < N; i++) {
+			assert(out[i] && malloc_usable_size(out[i]) >= sizes[k]);
+			memset(out[i], k * N + i, sizes[k]);
+		}
+	}
+
+	// Heap blocks of one batch are cut from one region
+	ptrdiff_t stride = (uint8_t*)ptrs[N + 1] - (uint8_t*)ptrs[N];
+	for (int i = 1; i < N; i++)
+		assert((uint8_t*)ptrs[N + i] - (uint8_t*)ptrs[N + i - 1] == stride);
+
+	for (int k = 0; k < 3; k++) {
+		for (int i = 0; i < N; i++) {
+			uint8_t* p = ptrs[k * N + i];
+			assert(p[0] == (uint8_t)(k * N + i) && p[sizes[k] - 1] == (uint8_t)(k * N + i));
+		}
+	}
+
+	// Mixed kinds in reverse order, with a NULL
+	for (int i = 0; i < 3 * N / 2; i++) {
+		void* t = ptrs[i];
+		ptrs[i] = ptrs[3 * N - 1 - i];
+		ptrs[3 * N - 1 - i] = t;
+	}
+	ptrs[3 * N] = NULL;
+	mm_free_batch(ptrs, 3 * N + 1);
+
+	// The heap blocks merged back into the region they were cut from
+	mm_get_stats(&after);
+	assert(after.heap_free_blocks <= before.heap_free_blocks + 1);
+	assert(after.mmap_chunks == before.mmap_chunks);
+
+	assert(mm_malloc_batch(0, N, ptrs) == 0);
+	assert(mm_malloc_batch(64, 0, ptrs) == 0);
+}
+
+void boundary_tag_test(void) {
+	uint8_t* p[3];
+	struct mm_stats before, after;
+
+	// Batches bypass the thread cache, so frees reach the heap right away
+	mm_get_stats(&before);
+	assert(mm_malloc_batch(1000, 3, (void**)p) == 3);
+
+	size_t usable = malloc_usable_size(p[0]);
+	for (int i = 0; i < 3; i++) {
+		assert(malloc_usable_size(p[i]) >= 1000);
+		memset(p[i], 0xA0 + i, malloc_usable_size(p[i]));
+	}
+
+#ifndef MM_DEBUG
+	// Only the size word sits between neighbours, the last word of a block is in the next header
+	assert(p[1] - p[0] == (ptrdiff_t)(usable + sizeof(size_t)));
+#endif
+
+	// Every usable byte can be kept in place
+	assert(realloc(p[0], usable) == p[0]);
+
+	// Freeing the middle block writes its tag into the last one's header
+	mm_free_batch((void**)&p[1], 1);
+	assert(p[0][usable - 1] == 0xA0);
+	assert(p[2][0] == 0xA2 && p[2][malloc_usable_size(p[2]) - 1] == 0xA2);
+
+	// Both neighbours merge with it, found through the tag and the prev-free bit
+	mm_free_batch((void**)&p[2], 1);
+	mm_free_batch((void**)&p[0], 1);
+
+	mm_get_stats(&after);
+	assert(after.heap_free_blocks <= before.heap_free_blocks + 1);
+}
+
+void fast_bin_test(void) {
+	enum { N = 64, CACHED = 16 };
+	void* p[N];
+	struct mm_stats before, after;
+
+	mm_trim(0);
+	mm_get_stats(&before);
+	assert(before.heap_fast_blocks == 0 && before.heap_fast_bytes == 0);
+
+	for (int i = 0; i < N; i++)
+		assert((p[i] = malloc(400)));
+
+	// The thread cache fills up first, the rest are held by the arena unmerged
+	for (int i = 0; i < N; i++)
+		free(p[i]);
+
+	mm_get_stats(&after);
+	assert(after.heap_fast_blocks >= N / 2);
+	assert(after.heap_free_blocks <= before.heap_free_blocks);
+	assert(mm_mallinfo2().smblks == after.heap_fast_blocks);
+
+	// Once the thread cache is empty, the last block held comes back first
+	for (int i = 0; i < CACHED; i++)
+		assert((p[i] = malloc(400)));
+	void* q = malloc(400);
+	assert(q == p[N - 1]);
+	free(q);
+
+	for (int i = 0; i < CACHED; i++)
+		free(p[i]);
+
+	// Trimming merges them all
+	mm_trim(0);
+	mm_get_stats(&after);
+	assert(after.heap_fast_blocks == 0 && after.heap_fast_bytes == 0);
+
+	// 0 turns the fast bins off
+	assert(mm_mallopt(MM_OPT_FAST_MAX_SIZE, 0));
+	for (int i = 0; i < N; i++)
+		assert((p[i] = malloc(400)));
+	for (int i = 0; i < N; i++)
+		free(p[i]);
+
+	mm_get_stats(&after);
+	assert(after.heap_fast_blocks == 0);
+
+	assert(!mm_mallopt(MM_OPT_FAST_MAX_SIZE, 2048));
+	assert(mm_mallopt(MM_OPT_FAST_MAX_SIZE, 512));
+	mm_trim(0);
+}
+
+enum { DEFERRED_WORKERS = 4, DEFERRED_BLOCKS = 1024 };
+static void* deferred_blocks[DEFERRED_BLOCKS];
+
+// Each worker frees every DEFERRED_WORKERS-th block, all at the same time
+static void* deferred_worker(void* arg) {
+	for (size_t i = (uintptr_t)arg; i < DEFERRED_BLOCKS; i += DEFERRED_WORKERS)
+		mm_free_deferred(deferred_blocks[i]);
+	return NULL;
+}
+
+void deferred_test(void) {
+	const size_t sizes[] = {48, 400, 3000, 200 * 1024};
+	struct mm_stats before, after;
+	size_t queued = 0;
+
+	mm_get_stats(&before);
+
+	for (int i = 0; i < DEFERRED_BLOCKS; i++) {
+		size_t size = sizes[i % 4];
+		assert((deferred_blocks[i] = malloc(size)));
+		memset(deferred_blocks[i], i, size);
+		// mmap chunks have no arena to defer to
+		queued += size < 128 * 1024;
+	}
+
+	pthread_t tids[DEFERRED_WORKERS];
+	for (int i = 0; i < DEFERRED_WORKERS; i++)
+		assert(pthread_create(&tids[i], NULL, deferred_worker, (void*)(uintptr_t)i) == 0);
+	for (int i = 0; i < DEFERRED_WORKERS; i++)
+		assert(pthread_join(tids[i], NULL) == 0);
+
+	// Draining takes every block pushed, none got lost between the workers
+	mm_trim(0);
+	mm_get_stats(&after);
+	assert(after.deferred_frees - before.deferred_frees == queued);
+	assert(after.mmap_chunks == before.mmap_chunks);
+
+	// The next malloc drains what's pushed from then on
+	void* p = malloc(3000);
+	mm_free_deferred(p);
+	mm_free_deferred(NULL);
+	void* q = malloc(3000);
+	assert(q);
+	free(q);
+	mm_get_stats(&after);
+	assert(after.deferred_frees - before.deferred_frees == queued + 1);
+}
+
+// Reads the header line of a dump, the live and cumulative totals, and checks the trailing lines
+static void read_profile(const char* path, size_t t[4], size_t* rate) {
+	FILE* f = fopen(path, "r");
+	assert(f);
+	assert(fscanf(f, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &t[0], &t[1], &t[2], &t[3], rate) == 5);
+
+	char line[256];
+	_Bool maps = 0, dropped = 0;
+	size_t n;
+	while (fgets(line, sizeof(line), f)) {
+		maps |= !strcmp(line, "MAPPED_LIBRARIES:\n");
+		dropped |= sscanf(line, "# dropped samples: %zu", &n) == 1;
+	}
+	assert(maps && dropped);
+
+	fclose(f);
+}
+
+static void* profile_thread(void* arg) {
+	void* volatile p = malloc(16);
+	free(p);
+	return arg;
+}
+
+void profile_test(void) {
+	enum { N = 1000, SIZE = 1000, BIG = 64 * 1024 };
+	static void* blocks[N];
+	char path[] = "/tmp/mm-profile-XXXXXX";
+	size_t t[4], rate;
+
+	int fd = mkstemp(path);
+	assert(fd != -1);
+	close(fd);
+
+	assert(!mm_mallopt(MM_OPT_PROFILE_RATE, 0));
+	assert(mm_mallopt(MM_OPT_PROFILE_RATE, 4096));
+	assert(mm_mallopt(MM_OPT_PROFILE, 1));
+
+	for (int i = 0; i < N; i++)
+		assert((blocks[i] = malloc(SIZE)));
+
+	// About 1 - e^(-1000 / 4096), a fifth, of the blocks are sampled
+	assert(mm_profile_dump(path));
+	read_profile(path, t, &rate);
+	assert(rate == 4096);
+	assert(t[0] > N / 10 && t[0] < N / 2 && t[1] == t[0] * SIZE);
+	assert(t[2] >= t[0] && t[3] >= t[1]);
+
+	size_t sampled = t[2];
+
+	// Freeing retires the samples, the cumulative profile keeps them
+	for (int i = 0; i < N; i++)
+		free(blocks[i]);
+
+	assert(mm_profile_dump(path));
+	read_profile(path, t, &rate);
+	assert(t[0] == 0 && t[1] == 0);
+	assert(t[2] >= sampled);
+
+	// At a rate of 1 byte every allocation is sampled, a realloc that fails
+	// or leaves the block as it was keeps its sample
+	// The thread's countdown still runs at the old rate, so the block is big enough to cross it
+	assert(mm_mallopt(MM_OPT_PROFILE_RATE, 1));
+	uint8_t* p = malloc(BIG);
+	assert(p);
+	assert(mm_profile_dump(path));
+	read_profile(path, t, &rate);
+	size_t live = t[0], live_bytes = t[1];
+	assert(live >= 1 && live_bytes >= BIG);
+
+	volatile size_t huge = (size_t)PTRDIFF_MAX + 1;
+	assert(!realloc(p, huge));
+	// Same size, so it stays in place
+	p = realloc(p, BIG);
+	assert(p);
+	assert(mm_profile_dump(path));
+	read_profile(path, t, &rate);
+	assert(t[0] == live && t[1] == live_bytes);
+
+	free(p);
+	assert(mm_profile_dump(path));
+	read_profile(path, t, &rate);
+	assert(t[0] == live - 1 && t[1] == live_bytes - BIG);
+
+	// A new thread's first allocation is sampled no more often than any other
+	assert(mm_mallopt(MM_OPT_PROFILE_RATE, 512 * 1024));
+	assert(mm_profile_dump(path));
+	read_profile(path, t, &rate);
+	sampled = t[2];
+
+	for (int i = 0; i < 8; i++) {
+		pthread_t th;
+		assert(!pthread_create(&th, NULL, profile_thread, NULL));
+		pthread_join(th, NULL);
+	}
+
+	assert(mm_profile_dump(path));
+	read_profile(path, t, &rate);
+	assert(t[2] < sampled + 4);
+
+	assert(mm_mallopt(MM_OPT_PROFILE, 0));
+	assert(mm_mallopt(MM_OPT_PROFILE_RATE, 512 * 1024));
+	assert(!mm_profile_dump("/nonexistent/profile"));
+	unlink(path);
+}
+
+void latency_test(void) {
+	enum { N = 1000 };
+	static struct mm_latency_stats s;
+	static void* blocks[N];
+
+	// Bucket bounds are log-linear and increasing
+	for (size_t i = 0; i < 8; i++)
+		assert(mm_latency_bucket_min(i) == i);
+	assert(mm_latency_bucket_min(8) == 8 && mm_latency_bucket_min(16) == 16 && mm_latency_bucket_min(17) == 18);
+	for (size_t i = 1; i < MM_LATENCY_BUCKETS; i++)
+		assert(mm_latency_bucket_min(i) > mm_latency_bucket_min(i - 1));
+
+	mm_reset_latency_stats();
+
+	for (int i = 0; i < N; i++)
+		assert((blocks[i] = malloc(3000)));
+	for (int i = 0; i < N; i++)
+		free(blocks[i]);
+
+	void* p = calloc(4, 100);
+	assert(p);
+	assert((p = realloc(p, 1000)));
+	free(p);
+
+	// Past the mmap threshold
+	assert((p = malloc(1 << 20)));
+	free(p);
+
+	if (!mm_get_latency_stats(&s)) {
+		for (size_t i = 0; i < MM_LATENCY_OPS; i++)
+			assert(s.ops[i].count == 0);
+		return;
+	}
+
+	assert(s.ops[MM_LATENCY_MALLOC].count == N + 1);
+	assert(s.ops[MM_LATENCY_FREE].count == N + 2);
+	assert(s.ops[MM_LATENCY_CALLOC].count == 1 && s.ops[MM_LATENCY_REALLOC].count == 1);
+	assert(s.ops[MM_LATENCY_MMAP_ALLOC].count >= 1 && s.ops[MM_LATENCY_MMAP_FREE].count >= 1);
+	assert(s.find_fit_scan.count > 0);
+
+	for (size_t i = 0; i < MM_LATENCY_OPS; i++) {
+		struct mm_latency_hist* h = &s.ops[i];
+		size_t total = 0;
+		for (size_t b = 0; b < MM_LATENCY_BUCKETS; b++)
+			total += h->buckets[b];
+
+		assert(total == h->count);
+		assert(mm_latency_quantile(h, 0.5) <= mm_latency_quantile(h, 0.99));
+		assert(mm_latency_quantile(h, 1) <= h->max);
+	}
+
+	mm_reset_latency_stats();
+	assert(mm_get_latency_stats(&s) && s.ops[MM_LATENCY_MALLOC].count == 0);
+}
@@ -0,0 +1,148 @@
+#include "interface.h"
+
+#ifdef MM_TRACE
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+static pthread_once_t mm_trace_once = PTHREAD_ONCE_INIT;
+static mm_trace_header_t* mm_trace_map = NULL;
+static mm_trace_record_t* mm_trace_ring = NULL;
+static uint64_t mm_trace_capacity = 0;
+static uint64_t mm_trace_start = 0;
+static _Bool mm_trace_off = 0;
+
+static uint32_t mm_trace_threads = 0;
+static MM_TLS uint32_t mm_trace_tid = 0;
+
+static uint64_t mm_trace_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Writes "mm-trace.<pid>" without snprintf, which may allocate
+static void mm_trace_default_name(char* buf, size_t len) {
+	const char prefix[] = "mm-trace.";
+	char digits[16];
+	size_t n = 0;
+
+	for (unsigned long pid = (unsigned long)getpid(); n == 0 || pid; pid /= 10)
+		digits[n++] = (char)('0' + pid % 10);
+
+	size_t i = 0;
+	for (; prefix[i] && i < len - 1; i++)
+		buf[i] = prefix[i];
+	while (n && i < len - 1)
+		buf[i++] = digits[--n];
+	buf[i] = '\0';
+}
+
+// Runs on the first traced call, nothing in here may allocate
+static void mm_trace_open(void) {
+	char name[64];
+	const char* path = getenv("MM_TRACE_FILE");
+	if (!path || !*path) {
+		mm_trace_default_name(name, sizeof(name));
+		path = name;
+	}
+
+	uint64_t capacity = MM_TRACE_RECORDS;
+	const char* s = getenv("MM_TRACE_RECORDS");
+	if (s && *s) {
+		char* end;
+		unsigned long long v = strtoull(s, &end, 0);
+		if (!*end && v)
+			capacity = MM_MIN(v, MM_TRACE_MAX_RECORDS);
+	}
+
+	size_t len = sizeof(mm_trace_header_t) + capacity * sizeof(mm_trace_record_t);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+#ifdef MM_DEBUG
+		perror("open");
+#endif
+		mm_trace_off = 1;
+		return;
+	}
+
+	if (ftruncate(fd, (off_t)len) == -1) {
+#ifdef MM_DEBUG
+		perror("ftruncate");
+#endif
+		close(fd);
+		mm_trace_off = 1;
+		return;
+	}
+
+	void* map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+#ifdef MM_DEBUG
+		perror("mmap");
+#endif
+		mm_trace_off = 1;
+		return;
+	}
+
+	mm_trace_map = map;
+	memcpy(mm_trace_map->magic, MM_TRACE_MAGIC, sizeof(mm_trace_map->magic));
+	mm_trace_map->version = MM_TRACE_VERSION;
+	mm_trace_map->record_size = sizeof(mm_trace_record_t);
+	mm_trace_map->capacity = capacity;
+	mm_trace_map->count = 0;
+
+	mm_trace_ring = (mm_trace_record_t*)(mm_trace_map + 1);
+	mm_trace_capacity = capacity;
+	mm_trace_start = mm_trace_now();
+}
+
+// The child would write into its parent's file, so it isn't traced
+static void mm_trace_child(void) { __atomic_store_n(&mm_trace_off, 1, __ATOMIC_RELAXED); }
+
+// pthread_atfork may allocate, so it's registered here rather than from inside malloc
+__attribute__((constructor)) static void mm_trace_ctor(void) { pthread_atfork(NULL, NULL, mm_trace_child); }
+
+// Returns NULL while tracing is off
+mm_trace_record_t* mm_trace_reserve(void) {
+	if (__atomic_load_n(&mm_trace_off, __ATOMIC_RELAXED))
+		return NULL;
+
+	pthread_once(&mm_trace_once, mm_trace_open);
+	if (!mm_trace_ring)
+		return NULL;
+
+	if (!mm_trace_tid)
+		mm_trace_tid = __atomic_add_fetch(&mm_trace_threads, 1, __ATOMIC_RELAXED);
+
+	uint64_t i = __atomic_fetch_add(&mm_trace_map->count, 1, __ATOMIC_RELAXED);
+	mm_trace_record_t* r = &mm_trace_ring[i % mm_trace_capacity];
+	r->ts_ns = mm_trace_now() - mm_trace_start;
+
+	return r;
+}
+
+void mm_trace_commit(mm_trace_record_t* r, uint8_t op, void* ptr, void* old, size_t size) {
+	if (!r)
+		return;
+
+	r->id = (uint64_t)(uintptr_t)ptr;
+	r->old = (uint64_t)(uintptr_t)old;
+	r->size = size;
+	r->thread = mm_trace_tid;
+
+	// Written last, so a reader never trusts a half-written record
+	__atomic_store_n(&r->op, op, __ATOMIC_RELEASE);
+}
+
+void mm_trace(uint8_t op, void* ptr, void* old, size_t size) { mm_trace_commit(mm_trace_reserve(), op, ptr, old, size); }
+
+#endif
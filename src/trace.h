@@ -0,0 +1,63 @@
+/*
+ * Trace file format, shared by the recorder and the replay tool.
+ *
+ * A trace is a file mapped MAP_SHARED by the traced process:
+ *   [ Header | Record 0 | Record 1 | ... | Record capacity - 1 ]
+ *
+ *   - count is the number of records ever written, the ring wraps at
+ *     capacity, so record i lives in slot i % capacity
+ *   - Blocks are identified by the address they had in the traced process
+ *   - A slot whose op is still 0 was reserved but never written
+ */
+
+#ifndef MM_TRACE_HEADER
+#define MM_TRACE_HEADER
+
+#include <stdint.h>
+
+#define MM_TRACE_MAGIC "MMTRACE1"
+#define MM_TRACE_VERSION 1
+
+// Default number of records in the ring, 160MiB of trace
+#define MM_TRACE_RECORDS ((uint64_t)1 << 22)
+// MM_TRACE_RECORDS is clamped to this, 40GiB of records, so the file's length can't overflow
+#define MM_TRACE_MAX_RECORDS ((uint64_t)1 << 30)
+
+enum {
+	MM_TRACE_MALLOC = 1,
+	MM_TRACE_FREE,
+	MM_TRACE_REALLOC,
+	MM_TRACE_CALLOC,
+	MM_TRACE_MEMALIGN,
+};
+
+typedef struct mm_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t capacity;
+	uint64_t count;
+} mm_trace_header_t;
+
+/*
+ * Record fields per op:
+ *   - MALLOC, CALLOC: id of the new block, size
+ *   - FREE: id of the freed block
+ *   - REALLOC: id of the new block, old is the id of the old block, size
+ *     The record is reserved before the old block is freed, so it comes before any reuse of that block
+ *     A failed realloc has id 0, its old block stays live
+ *   - MEMALIGN: id of the new block, old is the alignment, size
+ */
+typedef struct mm_trace_record {
+	uint64_t ts_ns;
+	uint64_t id;
+	uint64_t old;
+	uint64_t size;
+	uint32_t thread;
+	uint8_t op;
+	uint8_t pad[3];
+} mm_trace_record_t;
+
+_Static_assert(sizeof(mm_trace_record_t) == 40, "Trace records must stay 40 bytes");
+
+#endif